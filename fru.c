@@ -1,30 +1,77 @@
+#ifndef RECOVERY
+#include <common.h>
+#endif
 #include "fru.h"
 #include <stdbool.h>
 
 #define FRU_VERSION 1
 #define BOARD_AREA_VERSION 1
 #define PRODUCT_AREA_VERSION 1
-#define FRU_SIZE 4096
 #define TAG "FRU"
 
 #ifdef RECOVERY
 #include <string.h>
 #include <stdio.h>
-#include "common.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+static fru_log_fn fru_log_cb = NULL;
+
+static void
+fru_log(enum FRU_LOG_LEVEL level, const char *fmt, ...) {
+  va_list ap;
+  if (fru_log_cb == NULL) {
+    return;
+  }
+  va_start(ap, fmt);
+  fru_log_cb(level, fmt, ap);
+  va_end(ap);
+}
+
+void
+fru_set_log(fru_log_fn fn) {
+  fru_log_cb = fn;
+}
+
+static unsigned long
+fru_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+#define fmsg(...) {fru_log (FRU_LOG_MSG, __VA_ARGS__); }
+#define flog(...) {fru_log (FRU_LOG_INFO, "L["TAG"]: "__VA_ARGS__); }
+#define fwarn(...) {fru_log (FRU_LOG_WARN, "W["TAG"]: "__VA_ARGS__); }
+#define ferr(...) {fru_log (FRU_LOG_ERR, "E["TAG"]: "__VA_ARGS__); }
+
+#ifndef FRU_EEPROM_PATH
+#define FRU_EEPROM_PATH "/sys/bus/i2c/devices/1-0053/eeprom"
+#endif
+
+#define simple_strtoul strtoul
 
 #ifdef FRU_DEBUG
-#define fru_dbg(...) {fprintf (logfile, __VA_ARGS__); fflush(logfile); }
+#define fru_dbg(...) {fru_log (FRU_LOG_DEBUG, __VA_ARGS__); }
 #else
 #define fru_dbg(...)
 #endif
 
 #else
-#include <common.h>
 #include <i2c.h>
+#include <net.h>
 #define fmsg(...) {printf (__VA_ARGS__); }
 #define flog(...) {printf ("L["TAG"]: "__VA_ARGS__); }
 #define fwarn(...) {printf ("W["TAG"]: "__VA_ARGS__); }
 #define ferr(...) {printf ("E["TAG"]: "__VA_ARGS__); }
+#define fru_now_us() timer_get_us()
 
 #ifdef FRU_DEBUG
 #define fru_dbg(...) {printf (__VA_ARGS__); }
@@ -37,32 +84,112 @@
 static uint8_t fru_buf[FRU_SIZE];
 static uint8_t fru_buf2[FRU_SIZE];
 struct fru fru;
+static struct fru fru_stage;
+static bool fru_in_edit = false;
+static bool fru_cache_valid = false;
+#ifdef RECOVERY
+static bool fru_tolerant = false;
+#else
+/* a damaged record must not keep the board from booting */
+static bool fru_tolerant = true;
+#endif
+static int fru_cache_ret = 0;
+
+#ifndef FRU_TRACE_LEN
+#ifdef CONFIG_SPL_BUILD
+#define FRU_TRACE_LEN 1
+#else
+#define FRU_TRACE_LEN 256
+#endif
+#endif
+
+static struct fru_trace_ev fru_trace_buf[FRU_TRACE_LEN];
+static unsigned int fru_trace_head = 0;
+static unsigned int fru_trace_count = 0;
+static bool fru_trace_on = false;
+
+static const char *fru_trace_areas[] = {"header", "board", "product", "mrec"};
+
+/* Compact binary events, decoded only when somebody asks for them */
+static void
+fru_trace(uint8_t type, uint8_t arg, unsigned int offt, int val) {
+  struct fru_trace_ev *ev;
+  if (!fru_trace_on) {
+    return;
+  }
+  ev = &fru_trace_buf[fru_trace_head];
+  ev->ts_us = fru_now_us();
+  ev->offt = offt;
+  ev->val = val;
+  ev->type = type;
+  ev->arg = arg;
+  fru_trace_head = (fru_trace_head+1)%FRU_TRACE_LEN;
+  if (fru_trace_count < FRU_TRACE_LEN) {
+    fru_trace_count ++;
+  }
+}
+
+void
+fru_trace_enable(bool on) {
+  if (on && !fru_trace_on) {
+    fru_trace_head = 0;
+    fru_trace_count = 0;
+  }
+  fru_trace_on = on;
+}
+
+/* Copy out up to max events, starting with the first-th oldest one */
+unsigned int
+fru_trace_read(unsigned int first, struct fru_trace_ev *ev, unsigned int max) {
+  unsigned int i = 0;
+  unsigned int n = (first<fru_trace_count?fru_trace_count-first:0);
+  unsigned int start = (fru_trace_head+FRU_TRACE_LEN-fru_trace_count+first)%FRU_TRACE_LEN;
+  n = (max<n?max:n);
+  for (; i<n; i++) {
+    ev[i] = fru_trace_buf[(start+i)%FRU_TRACE_LEN];
+  }
+  return n;
+}
+
+int
+fru_trace_format(struct fru_trace_ev *ev, char *buf, unsigned int len) {
+  const char *area = (ev->arg<4?fru_trace_areas[ev->arg]:"?");
+  switch (ev->type) {
+  case FRU_EV_READ:
+    return snprintf(buf, len, "%10u read    offt=%u pages=%u err=%i", ev->ts_us, ev->offt, ev->arg, ev->val);
+  case FRU_EV_WRITE:
+    return snprintf(buf, len, "%10u write   page=%u err=%i", ev->ts_us, ev->offt/FRU_PAGE_SIZE, ev->val);
+  case FRU_EV_VERIFY:
+    return snprintf(buf, len, "%10u verify  page=%u mismatch, retry %i", ev->ts_us, ev->offt/FRU_PAGE_SIZE, ev->val);
+  case FRU_EV_AREA:
+    return snprintf(buf, len, "%10u area    %s at %u len=%i", ev->ts_us, area, ev->offt, ev->val);
+  case FRU_EV_CS:
+    return snprintf(buf, len, "%10u cs      %s at %u %s [0x%02x]", ev->ts_us, area, ev->offt, (ev->val == 0 ? "ok" : "bad"), ev->val&0xff);
+  case FRU_EV_MREC:
+    return snprintf(buf, len, "%10u mrec    [%02x] at %u ret=%i", ev->ts_us, ev->arg, ev->offt, ev->val);
+  case FRU_EV_LOCK:
+    return snprintf(buf, len, "%10u lock    %s wait=%i ms", ev->ts_us, (ev->arg ? "exclusive" : "shared"), ev->val);
+  default:
+    return snprintf(buf, len, "%10u ?       [%02x %02x %u %i]", ev->ts_us, ev->type, ev->arg, ev->offt, ev->val);
+  }
+}
 
-uint8_t
+static uint8_t
 calc_cs(uint8_t *buf, uint8_t size) {
   uint8_t cs = 0;
   int i = 0;
-  fru_dbg("CS:\n");
   for (;i<size; i++) {
     cs += buf[i];
-#ifdef FRU_DEBUG
-    if (i%8==0) {
-      fru_dbg("\n");
-    }
-    fru_dbg("0x%02x ", cs);
-#endif
   }
-  fru_dbg("\n");
   return cs;
 }
 
-int
+static int
 fru_mk_multirecord(uint8_t *buf, unsigned int buf_size, uint8_t record_type, bool end, uint8_t *record, uint8_t record_size) {
-  int i = 0;
   int size = 5+record_size;
   int remainder = buf_size-size;
 
-  if (remainder<=0) {
+  if (remainder<0) {
     return -1;
   }
   buf[0] = record_type;
@@ -71,29 +198,160 @@ fru_mk_multirecord(uint8_t *buf, unsigned int buf_size, uint8_t record_type, boo
   memcpy((buf+5), record, record_size);
   buf[3] = 256-calc_cs(buf+5, record_size);
   buf[4] = 256-calc_cs(buf, 4);
-  for (;i<size;i++) {
-    if (i%8==0) {
-      fru_dbg("\r\n");
+  return size;
+}
+
+#define FRU_TYPE_BINARY  0
+#define FRU_TYPE_BCDPLUS 1
+#define FRU_TYPE_6BIT    2
+#define FRU_TYPE_8BIT    3
+#define FRU_END_OF_FIELDS 0xc1
+
+static const char fru_bcdplus[16] = "0123456789 -.???";
+
+/* Decode in_len bytes of a type/length field into at most out_max chars */
+static unsigned int
+fru_decode_str(uint8_t type, uint8_t *in, unsigned int in_len, uint8_t *out, unsigned int out_max) {
+  unsigned int i = 0;
+  unsigned int n = 0;
+  unsigned int acc = 0;
+  unsigned int bits = 0;
+
+  switch (type) {
+  case FRU_TYPE_BCDPLUS:
+    for (; i<in_len && n+1<out_max; i++) {
+      out[n++] = fru_bcdplus[in[i]>>4];
+      out[n++] = fru_bcdplus[in[i]&0xf];
+    }
+    break;
+  case FRU_TYPE_6BIT:
+    /* four characters in three bytes, least significant bits first */
+    for (; i<in_len && n<out_max; i++) {
+      acc |= in[i]<<bits;
+      bits += 8;
+      while (bits >= 6 && n<out_max) {
+        out[n++] = (acc&0x3f)+0x20;
+        acc >>= 6;
+        bits -= 6;
+      }
     }
-    fru_dbg("%02x[%c] ", buf[i], (buf[i]>=0x20 ? buf[i] : ' '));
+    break;
+  default:
+    n = (in_len>out_max?out_max:in_len);
+    memcpy(out, in, n);
+    break;
   }
-  fru_dbg("\r\n");
-  return size;
+  return n;
 }
 
-int
-read_fru_str(uint8_t *buf, uint8_t *str, unsigned int *len, unsigned int offt) {
-  *len = ((buf[offt]>(FRU_STR_MAX-1))?(FRU_STR_MAX-1):buf[offt]);
+struct fru_field {
+  const char *name;
+  unsigned int len_offt;
+  unsigned int val_offt;
+};
+
+#define FRU_FIELD(key, name) {key, offsetof(struct fru, len_##name), offsetof(struct fru, val_##name)}
+
+/* Index into fru_fields is also the bit in fields_changed and
+   fields_truncated; the board fields come first, then the product ones */
+static const struct fru_field fru_fields[] = {
+  FRU_FIELD("b_mfg_name", mfg_name),
+  FRU_FIELD("b_product_name", product_name),
+  FRU_FIELD("b_serial_number", serial_number),
+  FRU_FIELD("b_part_number", part_number),
+  FRU_FIELD("b_fru_id", fru_id),
+  FRU_FIELD("p_product_mfg", p_product_mfg),
+  FRU_FIELD("p_product_name", p_product_name),
+  FRU_FIELD("p_part_model_number", p_part_model_number),
+  FRU_FIELD("p_product_version", p_product_version),
+  FRU_FIELD("p_serial_number", p_serial_number),
+  FRU_FIELD("p_fru_id", p_fru_id),
+};
+
+#define FRU_N_BOARD_FIELDS   5
+#define FRU_N_PRODUCT_FIELDS 6
+#define FRU_FIELD_MFG_DATE   11
+#define FRU_BOARD_FIELDS     (((1<<FRU_N_BOARD_FIELDS)-1) | (1<<FRU_FIELD_MFG_DATE))
+#define FRU_PRODUCT_FIELDS   (((1<<FRU_N_PRODUCT_FIELDS)-1)<<FRU_N_BOARD_FIELDS)
+
+#define FRU_FIELD_VAL(f, i) ((uint8_t *)(f)+fru_fields[i].val_offt)
+#define FRU_FIELD_LEN(f, i) (*(unsigned int *)((uint8_t *)(f)+fru_fields[i].len_offt))
+
+static int
+read_fru_str(uint8_t *buf, uint8_t *str, unsigned int *len, unsigned int offt, bool *truncated) {
+  unsigned int area_len = buf[1]*8;
+  unsigned int field_len;
+  unsigned int full_len;
+
   memset(str, 0, FRU_STR_MAX);
-  memcpy(str, &buf[offt+1], *len);
-  offt += buf[offt]+1;
+  *len = 0;
+  *truncated = false;
+  /* fields after the end marker are absent, keep pointing at it */
+  if (offt >= area_len || buf[offt] == FRU_END_OF_FIELDS) {
+    return offt;
+  }
+  field_len = buf[offt]&0x3f;
+  if (offt+1+field_len > area_len) {
+    fwarn("FRU: field at %i runs past the area end\n", offt);
+    return area_len;
+  }
+  *len = fru_decode_str(buf[offt]>>6, &buf[offt+1], field_len, str, FRU_STR_MAX-1);
+  switch (buf[offt]>>6) {
+  case FRU_TYPE_BCDPLUS:
+    full_len = field_len*2;
+    break;
+  case FRU_TYPE_6BIT:
+    full_len = field_len*8/6;
+    break;
+  default:
+    full_len = field_len;
+    break;
+  }
+  *truncated = (full_len > *len);
+  offt += field_len+1;
   return offt;
 }
 
-int
+#ifdef FRU_DEBUG
+static void
+print_board_area(struct fru *f) {
+  flog("FRU Board area:\n");
+  flog("Board mfg:          \t%s\n", f->val_mfg_name);
+  flog("Board name:         \t%s\n", f->val_product_name);
+  flog("Board serial number:\t%s\n", f->val_serial_number);
+  flog("Board part number:  \t%s\n", f->val_part_number);
+  flog("Board fru id:       \t%s\n", f->val_fru_id);
+}
+
+static void
+print_product_area(struct fru *f) {
+  flog("FRU Product area:\n");
+  flog("Product mfg:          \t%s\n", f->val_p_product_mfg);
+  flog("Product name:         \t%s\n", f->val_p_product_name);
+  flog("Product model number: \t%s\n", f->val_p_part_model_number);
+  flog("Product version:      \t%s\n", f->val_p_product_version);
+  flog("Product serial number:\t%s\n", f->val_p_serial_number);
+  flog("Product fru id:       \t%s\n", f->val_p_fru_id);
+}
+#endif
+
+static int
+parse_area_fields(struct fru *f, uint8_t *buf, unsigned int offt, int first, int n) {
+  bool truncated;
+  int i = first;
+  for (; i<first+n; i++) {
+    offt = read_fru_str(buf, FRU_FIELD_VAL(f, i), &FRU_FIELD_LEN(f, i), offt, &truncated);
+    if (truncated) {
+      fwarn("FRU: %s is longer than %i characters\n", fru_fields[i].name, FRU_STR_MAX-1);
+      f->fields_truncated |= (1<<i);
+    }
+  }
+  return offt;
+}
+
+static int
 parse_board_area(struct fru *f, uint8_t *buf, unsigned int buf_len) {
   uint8_t cs;
-  int offt = 0;
   
   if (buf[0] != BOARD_AREA_VERSION) {
     fwarn("FRU: Board area version is not valid\n");
@@ -103,21 +361,8 @@ parse_board_area(struct fru *f, uint8_t *buf, unsigned int buf_len) {
     fwarn("FRU: Board area size mismatch\n");
     return -2;
   }
-#ifdef FRU_DEBUG
-  {
-    int i = 0;
-    flog("FRU Board area bin:\n");
-    for (;i<buf[1]*8;i++) {
-      if ((i%8)==0) {
-        fru_dbg("\n");
-      }
-      fru_dbg("0x%02x[%c] ", buf[i], (buf[i]>' '?buf[i]:' '));
-    }
-    fru_dbg("\n");
-  }
-#endif
-
   cs = calc_cs(buf, buf[1]*8);
+  fru_trace(FRU_EV_CS, FRU_AREA_BOARD, f->board_area_offset, cs);
   if (cs != 0) {
     fwarn("FRU: Bad board area checksum [0-%i]: %i\n", buf[1]*8, cs);
     return -3;
@@ -126,31 +371,16 @@ parse_board_area(struct fru *f, uint8_t *buf, unsigned int buf_len) {
   f->mfg_date[1] = buf[4];
   f->mfg_date[2] = buf[5];
 
-  offt = 5;
-  offt = read_fru_str(buf, f->val_mfg_name, &f->len_mfg_name, offt);
-  offt = read_fru_str(buf, f->val_product_name, &f->len_product_name, offt);
-  offt = read_fru_str(buf, f->val_serial_number, &f->len_serial_number, offt);
-  offt = read_fru_str(buf, f->val_part_number, &f->len_part_number, offt);
-  offt = read_fru_str(buf, f->val_fru_id, &f->len_fru_id, offt);
+  parse_area_fields(f, buf, 6, 0, FRU_N_BOARD_FIELDS);
 #ifdef FRU_DEBUG
-  print_board_area(&fru);
+  print_board_area(f);
 #endif
   return 0;
 }
 
-void
-print_board_area(struct fru *f) {
-  flog("FRU Board area:\n");
-  flog("Board mfg:          \t%s\n", f->val_mfg_name);
-  flog("Board name:         \t%s\n", f->val_product_name);
-  flog("Board serial number:\t%s\n", f->val_serial_number);
-  flog("Board part number:  \t%s\n", f->val_part_number);
-  flog("Board fru id:       \t%s\n", f->val_fru_id);
-}
-
-int
+static int
 parse_product_area(struct fru *f, uint8_t *buf, unsigned int buf_len) {
-  int offt = 0;
+  uint8_t cs;
   if (buf[0] != PRODUCT_AREA_VERSION) {
     fwarn("FRU: Product area version is not valid\n");
     return -1;
@@ -159,69 +389,30 @@ parse_product_area(struct fru *f, uint8_t *buf, unsigned int buf_len) {
     fwarn("FRU: Product area size mismatch\n");
     return -2;
   }
-#ifdef FRU_DEBUG
-  {
-    int i = 0;
-    flog("FRU Product area bin:\n");
-    for (i=0; i<buf[1]*8; i++) {
-      if ((i%8)==0) {
-        fru_dbg("\n");
-      }
-      fru_dbg("0x%02x[%c] ", buf[i], (buf[i]>' '?buf[i]:' '));
-    }
-    fru_dbg("\n");
-  }
-#endif
-
-  if (calc_cs(buf, buf[1]*8) != 0) {
+  cs = calc_cs(buf, buf[1]*8);
+  fru_trace(FRU_EV_CS, FRU_AREA_PRODUCT, f->product_area_offset, cs);
+  if (cs != 0) {
     fwarn("FRU: Bad product area checksum\n");
     return -3;
   }
-  offt = 3;
-  offt = read_fru_str(buf, f->val_p_product_mfg, &f->len_p_product_mfg, offt);
-  offt = read_fru_str(buf, f->val_p_product_name, &f->len_p_product_name, offt);
-  offt = read_fru_str(buf, f->val_p_part_model_number, &f->len_p_part_model_number, offt);
-  offt = read_fru_str(buf, f->val_p_product_version, &f->len_p_product_version, offt);
-  offt = read_fru_str(buf, f->val_p_serial_number, &f->len_p_serial_number, offt);
-  offt = read_fru_str(buf, f->val_p_fru_id, &f->len_p_fru_id, offt);
+  parse_area_fields(f, buf, 3, FRU_N_BOARD_FIELDS, FRU_N_PRODUCT_FIELDS);
 #ifdef FRU_DEBUG
-  print_product_area(&fru);
+  print_product_area(f);
 #endif
   return 0;
 }
 
-void
-print_product_area(struct fru *f) {
-  flog("FRU Product area:\n");
-  flog("Product mfg:          \t%s\n", f->val_p_product_mfg);
-  flog("Product name:         \t%s\n", f->val_p_product_name);
-  flog("Product model number: \t%s\n", f->val_p_part_model_number);
-  flog("Product version:      \t%s\n", f->val_p_product_version);
-  flog("Product serial number:\t%s\n", f->val_p_serial_number);
-  flog("Product fru id:       \t%s\n", f->val_p_fru_id);
-}
-
-int
+static int
 fru_parse_multirecord(struct multirec *m, uint8_t *buf, unsigned int buf_len) {
   uint8_t data_cs;
   if (buf_len<5) {
     fwarn("FRU: no space in multirecord buffer, failed to parse header\n");
     return -4;
   }
-#ifdef FRU_DEBUG
-  {
-    int i = 0;
-    flog("FRU mrec header bin:\n");
-    for (;i<5;i++) {
-      fru_dbg("0x%02x[%c] ", buf[i], (buf[i]>' '?buf[i]:' '));
-    }
-    fru_dbg("\n");
-  }
-#endif
-
   if (calc_cs(buf, 5) != 0) {
     fwarn("FRU: multirecord header checksum is invalid\n");
     m->header_cs_ok = false;
+    m->cs_ok = false;
     return -1;
   } else {
     m->header_cs_ok = true;
@@ -241,31 +432,114 @@ fru_parse_multirecord(struct multirec *m, uint8_t *buf, unsigned int buf_len) {
     fwarn("FRU: no space in multirecord buffer, failed check data\n");
     return -5;
   }
-#ifdef FRU_DEBUG
-  {
-    int i = 0;
-    flog("FRU mrec bin:\n");
-    for (;i<(m->length+5);i++) {
-      if ((i%8)==0) {
-        fru_dbg("\n");
-      }
-      fru_dbg("0x%02x[%c] ", buf[i], (buf[i]>' '?buf[i]:' '));
-    }
-    fru_dbg("\n");
-  }
-#endif
   
   data_cs = calc_cs(&buf[5], m->length)+buf[3];
   if (data_cs != 0) {
     fwarn("FRU: multirecord data checksum is invalid [0x%02x]\n", data_cs);
+    m->cs_ok = false;
     return -3;
   }
+  m->cs_ok = true;
   m->data = &buf[5];
   return m->length+5;
 }
 
-int
+/* A valid header has a good checksum, a known format and a record length
+   that ends before limit */
+static bool
+fru_mrec_header_ok(uint8_t *buf, unsigned int offt, unsigned int limit) {
+  if (offt+5 > limit || calc_cs(&buf[offt], 5) != 0 || (buf[offt+1]&0x7) != 0x2) {
+    return false;
+  }
+  return (offt+5+buf[offt+2] <= limit);
+}
+
+/* A complete record has a valid header and a good data checksum */
+static bool
+fru_mrec_complete(uint8_t *buf, unsigned int offt, unsigned int limit) {
+  if (!fru_mrec_header_ok(buf, offt, limit)) {
+    return false;
+  }
+  return (((calc_cs(&buf[offt+5], buf[offt+2])+buf[offt+3])&0xff) == 0);
+}
+
+/* Find where the record after a damaged header starts. Whatever the header
+   says, the damaged record is at most 5+255 bytes long, so the search never
+   strays into bytes left past the end of the area. */
+static int
+fru_mrec_resync(uint8_t *buf, unsigned int offt, unsigned int limit) {
+  unsigned int claimed = offt+5+buf[offt+2];
+  unsigned int last = offt+5+0xff;
+
+  /* usually only the checksum or a flag bit is off and the length holds;
+     the next record may be damaged in its data only */
+  if (fru_mrec_header_ok(buf, claimed, limit)) {
+    return claimed;
+  }
+  if ((buf[offt+1]&0x87) == 0x82) {
+    /* claims to be the end record and nothing valid follows it */
+    return -1;
+  }
+  for (offt++; offt <= last; offt++) {
+    if (fru_mrec_complete(buf, offt, limit)) {
+      return offt;
+    }
+  }
+  return -1;
+}
+
+/* The multirecord area runs up to the next area in the header, if any */
+static unsigned int
+fru_mrec_area_limit(uint8_t *buf, unsigned int buf_len) {
+  unsigned int limit = buf_len;
+  unsigned int offt;
+  int i = 1;
+  for (; i<5; i++) {
+    offt = buf[i]*8;
+    if (offt > buf[5]*8 && offt < limit) {
+      limit = offt;
+    }
+  }
+  return limit;
+}
+
+/* Internal use and chassis info areas are not edited here, a rebuilt image
+   lays the other areas out around them. The internal use area has no length
+   of its own and runs up to whatever area follows it. */
+static unsigned int
+fru_internal_area_end(uint8_t *buf, unsigned int buf_len) {
+  unsigned int next = buf_len;
+  unsigned int offt;
+  int i = 2;
+
+  if (buf[1] == 0) {
+    return 0;
+  }
+  for (; i<6; i++) {
+    offt = buf[i]*8;
+    if (offt > buf[1]*8 && offt < next) {
+      next = offt;
+    }
+  }
+  return next;
+}
+
+static unsigned int
+fru_chassis_area_end(uint8_t *buf, unsigned int buf_len) {
+  unsigned int offt = buf[2]*8;
+
+  if (offt == 0 || offt+1 >= buf_len) {
+    return 0;
+  }
+  return (offt+buf[offt+1]*8 > buf_len ? buf_len : offt+buf[offt+1]*8);
+}
+
+static int
 parse_fru(struct fru *f, uint8_t *buf, unsigned int buf_len) {
+  struct multirec *m;
+  uint8_t cs;
+  unsigned int limit;
+  int next;
   int ret = 0;
   int mrec_n = 0;
   int offt = 0;
@@ -280,136 +554,580 @@ parse_fru(struct fru *f, uint8_t *buf, unsigned int buf_len) {
   } else if (buf[0] != FRU_VERSION) {
     fwarn("FRU: Header version is not valid\n");
     return -3;
-  } else if (calc_cs(buf, 8) != 0) {
-    fwarn("FRU: Bad header checksum: %i\n", calc_cs(buf, 8));
+  }
+  cs = calc_cs(buf, 8);
+  fru_trace(FRU_EV_CS, FRU_AREA_HEADER, 0, cs);
+  if (cs != 0) {
+    fwarn("FRU: Bad header checksum: %i\n", cs);
     return -4;
   }
   f->board_area_offset = buf[3]*8;
   f->product_area_offset = buf[4]*8;
   f->mrec_area_offset = buf[5]*8;
+  f->internal_area_offset = buf[1]*8;
+  f->chassis_area_offset = buf[2]*8;
+  f->internal_area_end = fru_internal_area_end(buf, buf_len);
+  f->chassis_area_end = fru_chassis_area_end(buf, buf_len);
+  fru_trace(FRU_EV_AREA, FRU_AREA_BOARD, f->board_area_offset, buf[f->board_area_offset+1]*8);
+  fru_trace(FRU_EV_AREA, FRU_AREA_PRODUCT, f->product_area_offset, buf[f->product_area_offset+1]*8);
+  fru_trace(FRU_EV_AREA, FRU_AREA_MREC, f->mrec_area_offset, 0);
+  f->areas_bad = false;
+  f->fields_changed = 0;
+  f->fields_truncated = 0;
   if (parse_board_area(f, &buf[f->board_area_offset], buf_len-f->board_area_offset)) {
-    return -5;
+    if (!fru_tolerant) {
+      return -5;
+    }
+    f->areas_bad = true;
   }
   if (parse_product_area(f, &buf[f->product_area_offset], buf_len-f->product_area_offset)) {
-    return -6;
+    if (!fru_tolerant) {
+      return -6;
+    }
+    f->areas_bad = true;
   }
   f->mrec_count = 0;
+  f->mrec_bad = 0;
+  f->mrec_area_end = 0;
+  if (f->mrec_area_offset == 0) {
+    fru_dbg("FRU: no multirecord area\n");
+    return 0;
+  }
+  limit = fru_mrec_area_limit(buf, buf_len);
   offt = f->mrec_area_offset;
-  while (ret >= 0 && (mrec_n < N_MULTIREC)) {
+  while (mrec_n < N_MULTIREC) {
     fru_dbg("FRU: parsing multirecord %i\n", f->mrec_count);
-    ret = fru_parse_multirecord(&f->mrec[mrec_n], &buf[offt], buf_len-offt);
-    if (ret > 0) {
-      f->mrec_count ++;
-    } else {
+    m = &f->mrec[mrec_n];
+    m->offset = offt;
+    ret = fru_parse_multirecord(m, &buf[offt], limit-offt);
+    fru_trace(FRU_EV_MREC, buf[offt], offt, ret);
+    if (ret < 0 && (!fru_tolerant || ret <= -4)) {
       fwarn("FRU: Failed to parse multirecord\n");
       return -7;
     }
-    if (f->mrec[mrec_n].end) {
+    f->mrec_count ++;
+    if (ret < 0) {
+      fwarn("FRU: Skipping damaged multirecord at %i\n", offt);
+      f->mrec_bad ++;
+      m->data = NULL;
+      if (ret == -3) {
+        /* only the data is bad, the header still tells where the next
+           record starts */
+        ret = m->length+5;
+      } else {
+        m->type = buf[offt];
+        m->cs_ok = false;
+        m->length = 0;
+        m->end = false;
+        next = fru_mrec_resync(buf, offt, limit);
+        if (next < 0) {
+          fwarn("FRU: No multirecord header after %i\n", offt);
+          /* nothing usable follows, take it as the last record */
+          m->end = true;
+          next = offt+5+buf[offt+2];
+          next = (next > limit ? limit : next);
+        }
+        ret = next-offt;
+      }
+    }
+    offt += ret;
+    if (m->end) {
       break;
-    } else {
-      offt += ret;
     }
     mrec_n ++;
   }
+  f->mrec_area_end = offt;
   return 0;
 }
 
-int
+static int
 fru_mk_multirecords_area(struct fru *f, uint8_t *buf, unsigned int buf_len) {
   int i = 0;
+  int last = -1;
   int ret = 0;
   unsigned int offt = 0;
   flog("Packing multirecord area\n");
+  /* damaged records carry no data and are dropped */
   for (;i<f->mrec_count; i++) {
+    if (f->mrec[i].data != NULL) {
+      last = i;
+    }
+  }
+  for (i=0;i<f->mrec_count; i++) {
+    if (f->mrec[i].data == NULL) {
+      flog("Dropping damaged [%02x]\n", f->mrec[i].type);
+      continue;
+    }
     flog("Packing [%02x]\n", f->mrec[i].type);
-    ret = fru_mk_multirecord(buf+offt, buf_len-offt, f->mrec[i].type, (f->mrec_count-i>1?false:true), f->mrec[i].data, f->mrec[i].length);
+    ret = fru_mk_multirecord(buf+offt, buf_len-offt, f->mrec[i].type, (i == last), f->mrec[i].data, f->mrec[i].length);
     if (ret < 0) {
-      fwarn("FRU: Failed to pack multirecord\n");
+      fru_dbg("FRU: [%02x] does not fit\n", f->mrec[i].type);
       return -1;
     }
     offt+=ret;
   }
-  return 0;
+  return offt;
 }
 
-int
-fru_mrec_update_mac(struct fru *f, uint8_t *mac, int iface) {
-  int i = 0;
-  static const int mac_mrec_id[N_MAC] = {MR_MAC_REC, MR_MAC2_REC, MR_MAC3_REC};
-  if (iface>=N_MAC) {
-    return -1;
-  }
-  memcpy(f->mac_data+iface*6, mac, 6);
-  for (; i<f->mrec_count; i++) {
-    if (f->mrec[i].type == mac_mrec_id[iface]) {
-      f->mrec[i].data = f->mac_data+iface*6;
-      return 0;
+static bool
+fru_fits_bcdplus(uint8_t *str, unsigned int len) {
+  unsigned int i = 0;
+  for (; i<len; i++) {
+    if (!((str[i]>='0' && str[i]<='9') || str[i]==' ' || str[i]=='-' || str[i]=='.')) {
+      return false;
     }
   }
-  return -1;
+  return true;
 }
 
-int
-fru_mrec_update_bootdevice(struct fru *f, uint8_t *bootdevice) {
-  int i = 0;
-  int len = strlen((char *)bootdevice);
-  len = (len>FRU_STR_MAX?FRU_STR_MAX:len);
-  memset(f->bootdevice, 0, FRU_STR_MAX);
-  memcpy(f->bootdevice, bootdevice, (len>FRU_STR_MAX?FRU_STR_MAX:len));
-  flog("Checking if bootdev mrec already exists\n");
-  for (; i<f->mrec_count; i++) {
-    if (f->mrec[i].type == MR_SATADEV_REC) {
-      flog("Found bootdev mrec, updating\n");
-      f->mrec[i].data = f->bootdevice;
-      f->mrec[i].length = len;
-      return 0;
+static bool
+fru_fits_6bit(uint8_t *str, unsigned int len) {
+  unsigned int i = 0;
+  for (; i<len; i++) {
+    if (str[i]<0x20 || str[i]>0x5f) {
+      return false;
     }
   }
-  flog("Bootdev mrec not found, creating mrec %i\n", f->mrec_count);
-  //no mrec for sata found, creating one
-  struct multirec *m = &(f->mrec[f->mrec_count]);
-  m->type = MR_SATADEV_REC;
-  m->format = 2;
-  m->end = true;
-  m->length = len;
-  m->data = f->bootdevice;
-  f->mrec_count ++;
-  return -1;
+  return true;
 }
 
-int
-fru_mrec_update_passwd_line(struct fru *f, uint8_t *passwd_line) {
-  int i = 0;
-  int len = strlen((char *)passwd_line);
-  len = (len>FRU_PWD_MAX?FRU_PWD_MAX:len);
-  memset(f->passwd_line, 0, FRU_PWD_MAX);
-  memcpy(f->passwd_line, passwd_line, (len>FRU_PWD_MAX?FRU_PWD_MAX:len));
-  flog("Checking if passwd line mrec already exists\n");
-  for (; i<f->mrec_count; i++) {
-    if (f->mrec[i].type == MR_PASSWD_REC) {
-      flog("Found passwd line mrec, updating\n");
-      f->mrec[i].data = f->passwd_line;
-      f->mrec[i].length = len;
-      return 0;
-    }
+static unsigned int
+fru_bcdplus_digit(uint8_t c) {
+  switch (c) {
+  case ' ':
+    return 0xa;
+  case '-':
+    return 0xb;
+  case '.':
+    return 0xc;
+  default:
+    return c-'0';
   }
-  flog("Passwd line mrec not found, creating mrec %i\n", f->mrec_count);
-  struct multirec *m = &(f->mrec[f->mrec_count]);
-  m->type = MR_PASSWD_REC;
-  m->format = 2;
-  m->end = true;
-  m->length = len;
-  m->data = f->passwd_line;
-  f->mrec_count ++;
-  return -1;
 }
 
-int
-fru_mrec_update_test_ok(struct fru *f, uint8_t test_ok) {
-  int i = 0;
-  f->test_ok = test_ok;
-  flog("Checking if test ok mrec already exists\n");
-  for (; i<f->mrec_count; i++) {
+/* Pick the densest encoding that decodes back to exactly the same string:
+   BCD plus only holds an even number of digits, 6-bit ASCII a length that
+   does not leave a spare character in its last byte. */
+static int
+fru_mk_str(uint8_t *buf, unsigned int buf_len, uint8_t *str, unsigned int len) {
+  unsigned int i = 0;
+  unsigned int n = len;
+  unsigned int acc = 0;
+  unsigned int bits = 0;
+  unsigned int packed = (len*6+7)/8;
+  uint8_t type = FRU_TYPE_8BIT;
+
+  if (len == 0) {
+    type = FRU_TYPE_8BIT;
+  } else if ((len%2) == 0 && fru_fits_bcdplus(str, len)) {
+    type = FRU_TYPE_BCDPLUS;
+    n = len/2;
+  } else if ((packed*8/6) == len && fru_fits_6bit(str, len)) {
+    type = FRU_TYPE_6BIT;
+    n = packed;
+  } else if (len == 1) {
+    /* 8-bit ASCII of length 1 would read as the end of fields marker */
+    type = FRU_TYPE_BINARY;
+  }
+  if (n > 0x3f) {
+    fwarn("FRU: field is too long to encode\n");
+    return -1;
+  }
+  if ((n+1) > buf_len) {
+    return -1;
+  }
+  buf[0] = (type<<6) | n;
+  switch (type) {
+  case FRU_TYPE_BCDPLUS:
+    for (; i<n; i++) {
+      buf[1+i] = (fru_bcdplus_digit(str[2*i])<<4) | fru_bcdplus_digit(str[2*i+1]);
+    }
+    break;
+  case FRU_TYPE_6BIT:
+    n = 0;
+    for (; i<len; i++) {
+      acc |= (str[i]-0x20)<<bits;
+      bits += 6;
+      while (bits >= 8) {
+        buf[1+n++] = acc&0xff;
+        acc >>= 8;
+        bits -= 8;
+      }
+    }
+    if (bits > 0) {
+      buf[1+n++] = acc&0xff;
+    }
+    break;
+  default:
+    memcpy(buf+1, str, n);
+    break;
+  }
+  return n+1;
+}
+
+static int
+fru_mk_area_end(uint8_t *buf, unsigned int buf_len, unsigned int offt) {
+  if ((offt+1) > buf_len) {
+    return -1;
+  }
+  buf[offt++] = FRU_END_OF_FIELDS;
+  while (((offt+1)%8) != 0) {
+    if (offt >= buf_len) {
+      return -1;
+    }
+    buf[offt++] = 0;
+  }
+  if (offt >= buf_len) {
+    return -1;
+  }
+  buf[1] = (offt+1)/8;
+  buf[offt] = 256-calc_cs(buf, offt);
+  return offt+1;
+}
+
+/* Encode the board or product area. With tmpl, the area as parsed, the
+   fields nobody changed are copied over as raw bytes, and so are the
+   language code and whatever fields follow the ones struct fru holds:
+   custom fields and the product FRU file ID. An area without changes is
+   copied verbatim. */
+static int
+fru_mk_area(struct fru *f, uint8_t area, uint8_t *buf, unsigned int buf_len, uint8_t *tmpl) {
+  bool board = (area == FRU_AREA_BOARD);
+  int first = (board ? 0 : FRU_N_BOARD_FIELDS);
+  int n = (board ? FRU_N_BOARD_FIELDS : FRU_N_PRODUCT_FIELDS);
+  unsigned int offt = (board ? 6 : 3);
+  unsigned int toff = offt;
+  unsigned int tlen = (tmpl != NULL ? tmpl[1]*8 : 0);
+  unsigned int len;
+  int i = first;
+  int ret = 0;
+
+  if (tmpl != NULL && (f->fields_changed & (board ? FRU_BOARD_FIELDS : FRU_PRODUCT_FIELDS)) == 0) {
+    if (tlen > buf_len) {
+      return -1;
+    }
+    memcpy(buf, tmpl, tlen);
+    return tlen;
+  }
+  if (buf_len < offt) {
+    return -1;
+  }
+  buf[0] = (board ? BOARD_AREA_VERSION : PRODUCT_AREA_VERSION);
+  buf[2] = (tmpl != NULL ? tmpl[2] : 0);
+  if (board && tmpl != NULL && (f->fields_changed & (1<<FRU_FIELD_MFG_DATE)) == 0) {
+    memcpy(buf+3, tmpl+3, 3);
+  } else if (board) {
+    memcpy(buf+3, f->mfg_date, 3);
+  }
+  for (; i<first+n; i++) {
+    len = 0;
+    if (toff < tlen && tmpl[toff] != FRU_END_OF_FIELDS) {
+      len = 1+(tmpl[toff]&0x3f);
+    }
+    if (len > 0 && (f->fields_changed & (1<<i)) == 0) {
+      if (toff+len > tlen || offt+len > buf_len) {
+        return -1;
+      }
+      memcpy(buf+offt, tmpl+toff, len);
+      ret = len;
+    } else if (f->fields_truncated & (1<<i)) {
+      fwarn("FRU: %s was truncated when parsed, not writing it back\n", fru_fields[i].name);
+      return -2;
+    } else {
+      ret = fru_mk_str(buf+offt, buf_len-offt, FRU_FIELD_VAL(f, i), FRU_FIELD_LEN(f, i));
+      if (ret < 0) {
+        return -1;
+      }
+    }
+    offt += ret;
+    toff += len;
+  }
+  while (toff < tlen && tmpl[toff] != FRU_END_OF_FIELDS) {
+    len = 1+(tmpl[toff]&0x3f);
+    if (toff+len > tlen || offt+len > buf_len) {
+      return -1;
+    }
+    memcpy(buf+offt, tmpl+toff, len);
+    offt += len;
+    toff += len;
+  }
+  return fru_mk_area_end(buf, buf_len, offt);
+}
+
+int
+fru_mk_board_area(struct fru *f, uint8_t *buf, unsigned int buf_len) {
+  return fru_mk_area(f, FRU_AREA_BOARD, buf, buf_len, NULL);
+}
+
+int
+fru_mk_product_area(struct fru *f, uint8_t *buf, unsigned int buf_len) {
+  return fru_mk_area(f, FRU_AREA_PRODUCT, buf, buf_len, NULL);
+}
+
+static void
+fru_mk_header(struct fru *f, uint8_t *buf) {
+  buf[0] = FRU_VERSION;
+  buf[1] = f->internal_area_offset/8;
+  buf[2] = f->chassis_area_offset/8;
+  buf[3] = f->board_area_offset/8;
+  buf[4] = f->product_area_offset/8;
+  buf[5] = f->mrec_area_offset/8;
+  buf[6] = 0;
+  buf[7] = 256-calc_cs(buf, 7);
+}
+
+/* Find room for an area at or after *offt that stays clear of the kept
+   internal use and chassis info areas. Returns how much fits there. */
+static unsigned int
+fru_mk_room(struct fru *f, unsigned int *offt, unsigned int buf_len) {
+  unsigned int start[2] = {f->internal_area_offset, f->chassis_area_offset};
+  unsigned int end[2] = {f->internal_area_end, f->chassis_area_end};
+  unsigned int limit = buf_len;
+  int i = 0;
+
+  for (; i<2; i++) {
+    if (start[i] != 0 && *offt >= start[i] && *offt < end[i]) {
+      *offt = end[i];
+      i = -1;
+    }
+  }
+  for (i=0; i<2; i++) {
+    if (start[i] != 0 && start[i] >= *offt && start[i] < limit) {
+      limit = start[i];
+    }
+  }
+  return (*offt < limit ? limit-*offt : 0);
+}
+
+/* Next kept area above offt, where a gap that turned out too small ends */
+static unsigned int
+fru_mk_skip(struct fru *f, unsigned int offt, unsigned int buf_len) {
+  unsigned int room = fru_mk_room(f, &offt, buf_len);
+  return (offt+room < buf_len ? offt+room : 0);
+}
+
+/* base is the image f was parsed from, or NULL to encode the areas from
+   f alone. The areas go into the first gap between the kept areas they
+   fit in, starting right after the header. */
+static int
+fru_mk_areas(struct fru *f, uint8_t *buf, unsigned int buf_len, uint8_t *base) {
+  uint8_t *board = ((base != NULL && f->board_area_offset != 0) ? base+f->board_area_offset : NULL);
+  uint8_t *product = ((base != NULL && f->product_area_offset != 0) ? base+f->product_area_offset : NULL);
+  int ret = 0;
+  unsigned int room;
+  unsigned int offt = 8;
+
+  flog("Packing board area\n");
+  do {
+    room = fru_mk_room(f, &offt, buf_len);
+    ret = fru_mk_area(f, FRU_AREA_BOARD, buf+offt, room, board);
+  } while (ret == -1 && (offt = fru_mk_skip(f, offt, buf_len)) != 0);
+  if (ret < 0) {
+    return -1;
+  }
+  f->board_area_offset = offt;
+  offt += ret;
+  flog("Packing product area\n");
+  do {
+    room = fru_mk_room(f, &offt, buf_len);
+    ret = fru_mk_area(f, FRU_AREA_PRODUCT, buf+offt, room, product);
+  } while (ret == -1 && (offt = fru_mk_skip(f, offt, buf_len)) != 0);
+  if (ret < 0) {
+    return -2;
+  }
+  f->product_area_offset = offt;
+  offt += ret;
+  do {
+    room = fru_mk_room(f, &offt, buf_len);
+    ret = fru_mk_multirecords_area(f, buf+offt, room);
+  } while (ret < 0 && (offt = fru_mk_skip(f, offt, buf_len)) != 0);
+  if (ret < 0) {
+    return -3;
+  }
+  f->mrec_area_offset = (ret > 0 ? offt : 0);
+  offt += ret;
+  fru_mk_header(f, buf);
+  return offt;
+}
+
+/* Areas kept from the parsed image must already be in buf */
+int
+fru_mk_full_image(struct fru *f, uint8_t *buf, unsigned int buf_len) {
+  return fru_mk_areas(f, buf, buf_len, NULL);
+}
+
+const uint8_t *
+fru_get_field(struct fru *f, const char *name) {
+  int i = 0;
+  for (; i<sizeof(fru_fields)/sizeof(fru_fields[0]); i++) {
+    if (strcmp(name, fru_fields[i].name) == 0) {
+      return FRU_FIELD_VAL(f, i);
+    }
+  }
+  return NULL;
+}
+
+int
+fru_mrec_get(struct fru *f, uint8_t type, uint8_t **data, unsigned int *len) {
+  int i = 0;
+  for (; i<f->mrec_count; i++) {
+    if (f->mrec[i].type == type && f->mrec[i].data != NULL) {
+      *data = f->mrec[i].data;
+      *len = f->mrec[i].length;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int
+fru_set_field(struct fru *f, const char *name, const char *val) {
+  int i = 0;
+  unsigned int len = strlen(val);
+  unsigned long date;
+
+  /* a damaged area was parsed as empty, setting a field would rebuild it
+     from nothing */
+  if (f->areas_bad) {
+    fwarn("FRU: board or product area is damaged, not setting %s\n", name);
+    return -1;
+  }
+  if (strcmp(name, "b_mfg_date") == 0) {
+    /* minutes since 1996-01-01 00:00, little endian */
+    date = simple_strtoul(val, NULL, 0);
+    f->mfg_date[0] = date&0xff;
+    f->mfg_date[1] = (date>>8)&0xff;
+    f->mfg_date[2] = (date>>16)&0xff;
+    f->fields_changed |= (1<<FRU_FIELD_MFG_DATE);
+    f->areas_changed = true;
+    return 0;
+  }
+  for (; i<sizeof(fru_fields)/sizeof(fru_fields[0]); i++) {
+    if (strcmp(name, fru_fields[i].name) == 0) {
+      if (len > FRU_STR_MAX-1) {
+        fwarn("FRU: %s is limited to %i characters\n", name, FRU_STR_MAX-1);
+        return -1;
+      }
+      memset(FRU_FIELD_VAL(f, i), 0, FRU_STR_MAX);
+      memcpy(FRU_FIELD_VAL(f, i), val, len);
+      FRU_FIELD_LEN(f, i) = len;
+      f->fields_changed |= (1<<i);
+      f->fields_truncated &= ~(1<<i);
+      f->areas_changed = true;
+      return 0;
+    }
+  }
+  fwarn("FRU: unknown field %s\n", name);
+  return -1;
+}
+
+void
+fru_init(struct fru *f) {
+  memset(f, 0, sizeof(struct fru));
+  f->mac0 = f->mac_data;
+  f->mac1 = f->mac_data+6;
+  f->mac2 = f->mac_data+12;
+  f->areas_changed = true;
+}
+
+int
+fru_mrec_update_mac(struct fru *f, uint8_t *mac, int iface) {
+  int i = 0;
+  static const int mac_mrec_id[N_MAC] = {MR_MAC_REC, MR_MAC2_REC, MR_MAC3_REC};
+  if (iface>=N_MAC) {
+    return -1;
+  }
+  memcpy(f->mac_data+iface*6, mac, 6);
+  for (; i<f->mrec_count; i++) {
+    if (f->mrec[i].type == mac_mrec_id[iface]) {
+      f->mrec[i].data = f->mac_data+iface*6;
+      f->mrec[i].length = 6;
+      return 0;
+    }
+  }
+  if (f->mrec_count >= N_MULTIREC) {
+    fwarn("FRU: no free multirecord slots\n");
+    return -1;
+  }
+  struct multirec *m = &(f->mrec[f->mrec_count]);
+  m->type = mac_mrec_id[iface];
+  m->format = 2;
+  m->end = true;
+  m->length = 6;
+  m->data = f->mac_data+iface*6;
+  f->mrec_count ++;
+  return 0;
+}
+
+int
+fru_mrec_update_bootdevice(struct fru *f, uint8_t *bootdevice) {
+  int i = 0;
+  int len = strlen((char *)bootdevice);
+  len = (len>FRU_STR_MAX?FRU_STR_MAX:len);
+  memset(f->bootdevice, 0, FRU_STR_MAX);
+  memcpy(f->bootdevice, bootdevice, (len>FRU_STR_MAX?FRU_STR_MAX:len));
+  flog("Checking if bootdev mrec already exists\n");
+  for (; i<f->mrec_count; i++) {
+    if (f->mrec[i].type == MR_SATADEV_REC) {
+      flog("Found bootdev mrec, updating\n");
+      f->mrec[i].data = f->bootdevice;
+      f->mrec[i].length = len;
+      return 0;
+    }
+  }
+  flog("Bootdev mrec not found, creating mrec %i\n", f->mrec_count);
+  if (f->mrec_count >= N_MULTIREC) {
+    fwarn("FRU: no free multirecord slots\n");
+    return -1;
+  }
+  //no mrec for sata found, creating one
+  struct multirec *m = &(f->mrec[f->mrec_count]);
+  m->type = MR_SATADEV_REC;
+  m->format = 2;
+  m->end = true;
+  m->length = len;
+  m->data = f->bootdevice;
+  f->mrec_count ++;
+  return 0;
+}
+
+int
+fru_mrec_update_passwd_line(struct fru *f, uint8_t *passwd_line) {
+  int i = 0;
+  int len = strlen((char *)passwd_line);
+  len = (len>FRU_PWD_MAX?FRU_PWD_MAX:len);
+  memset(f->passwd_line, 0, FRU_PWD_MAX);
+  memcpy(f->passwd_line, passwd_line, (len>FRU_PWD_MAX?FRU_PWD_MAX:len));
+  flog("Checking if passwd line mrec already exists\n");
+  for (; i<f->mrec_count; i++) {
+    if (f->mrec[i].type == MR_PASSWD_REC) {
+      flog("Found passwd line mrec, updating\n");
+      f->mrec[i].data = f->passwd_line;
+      f->mrec[i].length = len;
+      return 0;
+    }
+  }
+  flog("Passwd line mrec not found, creating mrec %i\n", f->mrec_count);
+  if (f->mrec_count >= N_MULTIREC) {
+    fwarn("FRU: no free multirecord slots\n");
+    return -1;
+  }
+  struct multirec *m = &(f->mrec[f->mrec_count]);
+  m->type = MR_PASSWD_REC;
+  m->format = 2;
+  m->end = true;
+  m->length = len;
+  m->data = f->passwd_line;
+  f->mrec_count ++;
+  return 0;
+}
+
+int
+fru_mrec_update_test_ok(struct fru *f, uint8_t test_ok) {
+  int i = 0;
+  f->test_ok = test_ok;
+  flog("Checking if test ok mrec already exists\n");
+  for (; i<f->mrec_count; i++) {
     if (f->mrec[i].type == MR_TESTOK_REC) {
       flog("Found test ok mrec, updating\n");
       f->mrec[i].data = &f->test_ok;
@@ -418,6 +1136,10 @@ fru_mrec_update_test_ok(struct fru *f, uint8_t test_ok) {
     }
   }
   flog("Test ok mrec not found, creating mrec %i\n", f->mrec_count);
+  if (f->mrec_count >= N_MULTIREC) {
+    fwarn("FRU: no free multirecord slots\n");
+    return -1;
+  }
   struct multirec *m = &(f->mrec[f->mrec_count]);
   m->type = MR_TESTOK_REC;
   m->format = 2;
@@ -425,7 +1147,7 @@ fru_mrec_update_test_ok(struct fru *f, uint8_t test_ok) {
   m->length = 1;
   m->data = &f->test_ok;
   f->mrec_count ++;
-  return -1;
+  return 0;
 }
 
 int
@@ -444,6 +1166,10 @@ fru_mrec_update_power_policy(struct fru *f, enum POWER_POLICY pp) {
     }
   }
   flog("Power policy mrec not found, creating mrec %i\n", f->mrec_count);
+  if (f->mrec_count >= N_MULTIREC) {
+    fwarn("FRU: no free multirecord slots\n");
+    return -1;
+  }
   struct multirec *m = &(f->mrec[f->mrec_count]);
   m->type = MR_POWER_POLICY_REC;
   m->format = 2;
@@ -452,7 +1178,7 @@ fru_mrec_update_power_policy(struct fru *f, enum POWER_POLICY pp) {
   m->data = &f->power_policy;
   flog("Setting data: %02x\n", m->data[0]);
   f->mrec_count ++;
-  return -1;
+  return 0;
 }
 
 int
@@ -469,6 +1195,10 @@ fru_mrec_update_power_state(struct fru *f) {
     }
   }
   flog("Power policy mrec not found, creating mrec %i\n", f->mrec_count);
+  if (f->mrec_count >= N_MULTIREC) {
+    fwarn("FRU: no free multirecord slots\n");
+    return -1;
+  }
   struct multirec *m = &(f->mrec[f->mrec_count]);
   m->type = MR_POWER_STATE_REC;
   m->format = 2;
@@ -476,111 +1206,247 @@ fru_mrec_update_power_state(struct fru *f) {
   m->length = 1;
   m->data = &f->power_state;
   f->mrec_count ++;
-  return -1;
+  return 0;
 }
 
+struct fru_part {
+  const char *name;
+  unsigned int size;
+  unsigned int t_wr_us;
+};
+
+/* 24Cxx parts the board can be populated with, identified by size */
+static const struct fru_part fru_parts[] = {
+  {"24c32",  4096,  5000},
+  {"24c64",  8192,  5000},
+  {"24c128", 16384, 5000},
+  {"24c256", 32768, 5000},
+  {"24c512", 65536, 5000},
+};
+
+#define FRU_I2C_HZ 100000
+
 #ifdef RECOVERY
-int
-read_fru(uint8_t *fru_buf) {
-  FILE *f = fopen("/sys/bus/i2c/devices/1-0053/eeprom", "r");
-  int ret = 0;
-  if (f == NULL) {
-    ferr("FRU: failed to open eeprom\n");
+static unsigned int
+fru_dev_size(void) {
+  struct stat st;
+  if (stat(FRU_EEPROM_PATH, &st) != 0 || st.st_size <= 0) {
+    return FRU_SIZE;
+  }
+  return st.st_size;
+}
+
+static int fru_lock_fd = -1;
+static unsigned int fru_lock_depth = 0;
+static unsigned long fru_lock_wait = 0;
+
+/* Advisory flock() on the EEPROM node: shared for readers, exclusive for
+   the read-modify-write cycle. Nested calls reuse the lock already held. */
+static int
+fru_lock(bool exclusive) {
+  unsigned long t0;
+  int op = (exclusive ? LOCK_EX : LOCK_SH);
+
+  if (fru_lock_depth > 0) {
+    fru_lock_depth ++;
+    return 0;
+  }
+  fru_lock_fd = open(FRU_EEPROM_PATH, O_RDONLY);
+  if (fru_lock_fd < 0) {
+    ferr("FRU: failed to open eeprom for locking\n");
     return -1;
   }
-  fru_dbg("Reading eeprom\n");
-  ret = fread(fru_buf, sizeof(uint8_t), FRU_SIZE, f);
-  fru_dbg("Read %i bytes\n", ret);
-  fclose(f);
+  fru_lock_wait = 0;
+  if (flock(fru_lock_fd, op | LOCK_NB) != 0) {
+    if (errno != EWOULDBLOCK) {
+      ferr("FRU: failed to lock eeprom\n");
+      close(fru_lock_fd);
+      fru_lock_fd = -1;
+      return -1;
+    }
+    t0 = fru_now_us();
+    if (flock(fru_lock_fd, op) != 0) {
+      ferr("FRU: failed to lock eeprom\n");
+      close(fru_lock_fd);
+      fru_lock_fd = -1;
+      return -1;
+    }
+    fru_lock_wait = fru_now_us()-t0;
+    fru_trace(FRU_EV_LOCK, exclusive, 0, (fru_lock_wait/1000>0x7fff?0x7fff:fru_lock_wait/1000));
+    flog("Waited %lu us for %s eeprom lock\n", fru_lock_wait, (exclusive ? "exclusive" : "shared"));
+  }
+  fru_lock_depth = 1;
   return 0;
 }
 
-int
-fru_update_mrec_eeprom(void) {
-  int ret = 0;
+static void
+fru_unlock(void) {
+  if (fru_lock_depth == 0 || --fru_lock_depth > 0) {
+    return;
+  }
+  close(fru_lock_fd);
+  fru_lock_fd = -1;
+}
+
+unsigned long
+fru_lock_wait_us(void) {
+  return fru_lock_wait;
+}
+
+static void
+fru_retry_delay(void) {
+  usleep(FRU_RETRY_DELAY_MS*1000);
+}
+
+/* Returns the number of bytes read, short past the end of the part */
+static int
+fru_read_bytes(uint8_t *dst, unsigned int offt, unsigned int len) {
   FILE *f = NULL;
-  memcpy(fru_buf2, fru_buf, fru.mrec_area_offset);
-  fru_dbg("Put multirecord area at %i\n", fru.mrec_area_offset);
-  ret = fru_mk_multirecords_area(&fru, fru_buf2+fru.mrec_area_offset, FRU_SIZE-fru.mrec_area_offset);
-  if (ret < 0) {
+  int ret = 0;
+  if (fru_lock(false) != 0) {
     return -1;
   }
-  flog("Writing eeprom ");
-  f = fopen("/sys/bus/i2c/devices/1-0053/eeprom", "w");
+  f = fopen(FRU_EEPROM_PATH, "r");
   if (f == NULL) {
     ferr("FRU: failed to open eeprom\n");
+    fru_unlock();
     return -1;
   }
-  ret = fwrite(fru_buf2, sizeof(uint8_t), FRU_SIZE, f);
-  fru_dbg("Wrote %i bytes\n", ret);
+  fru_dbg("Reading eeprom\n");
+  if (fseek(f, offt, SEEK_SET) == 0) {
+    ret = fread(dst, sizeof(uint8_t), len, f);
+  }
+  fru_trace(FRU_EV_READ, (len+FRU_PAGE_SIZE-1)/FRU_PAGE_SIZE, offt, (ret == len ? 0 : -1));
+  fru_dbg("Read %i bytes\n", ret);
   fclose(f);
+  fru_unlock();
+  return ret;
+}
+
+static int
+read_fru_at(uint8_t *dst, unsigned int offt, unsigned int len) {
+  if (fru_read_bytes(dst, offt, len) != len) {
+    ferr("FRU: failed to read eeprom [%i:%i]\n", offt, len);
+    return -1;
+  }
   return 0;
 }
-#else
-int
+
+static int
 read_fru(uint8_t *fru_buf) {
-  int ret = 0;
-  int i;
-  fru_dbg("Reading eeprom\n");
-  if (i2c_set_bus_num(CONFIG_SYS_OEM_BUS_NUM)) {
-		return -1;
+  /* short parts and images are fine when reading the whole FRU */
+  if (fru_read_bytes(fru_buf, 0, FRU_SIZE) <= 0) {
+    ferr("FRU: failed to read eeprom\n");
+    return -1;
   }
+  return 0;
+}
 
-  for (i=0;i<FRU_SIZE;i+=32) {
-    ret = i2c_read(CONFIG_SYS_OEM_I2C_ADDR | 1, i, 2, fru_buf+i, 32);
-    if (ret != 0) {
-      ferr("FRU: failed to read eeprom [%i]\n", ret);
-      return -1;
+static int
+write_fru_pages(uint8_t *buf, struct fru_write_cost *c) {
+  unsigned int p;
+  FILE *f = fopen(FRU_EEPROM_PATH, "r+");
+  if (f == NULL) {
+    ferr("FRU: failed to open eeprom\n");
+    return -1;
+  }
+  for (p=0; p<FRU_N_PAGES; p++) {
+    if (!FRU_PAGE_DIRTY(c, p)) {
+      continue;
+    }
+    if ((fseek(f, p*FRU_PAGE_SIZE, SEEK_SET) != 0) ||
+        (fwrite(buf+p*FRU_PAGE_SIZE, sizeof(uint8_t), FRU_PAGE_SIZE, f) != FRU_PAGE_SIZE) ||
+        (fflush(f) != 0)) {
+      fru_trace(FRU_EV_WRITE, 0, p*FRU_PAGE_SIZE, -1);
+      ferr("FRU: failed to write eeprom page %i\n", p);
+      fclose(f);
+      return -3;
     }
+    fru_trace(FRU_EV_WRITE, 0, p*FRU_PAGE_SIZE, 0);
+  }
+  if (fclose(f) != 0) {
+    ferr("FRU: failed to flush eeprom\n");
+    return -3;
+  }
+  return 0;
+}
+#else
+static unsigned int
+fru_dev_size(void) {
+  return FRU_SIZE;
+}
 
-#ifdef FRU_DEBUG
-    int j;
-    for (j=i;j<32+i;j++) {
-      if ((j%8)==0) {
-        fru_dbg("\n");
+/* nothing else touches the EEPROM while the bootloader runs */
+static int
+fru_lock(bool exclusive) {
+  return 0;
+}
+
+static void
+fru_unlock(void) {
+}
+
+/* Largest transfer the I2C controller driver accepts in one i2c_read();
+   24Cxx parts roll over page boundaries on sequential reads. */
+#ifndef CONFIG_SYS_OEM_I2C_READ_MAX
+#define CONFIG_SYS_OEM_I2C_READ_MAX FRU_SIZE
+#endif
+
+static unsigned int fru_read_chunk = CONFIG_SYS_OEM_I2C_READ_MAX;
+
+static int
+read_fru_at(uint8_t *dst, unsigned int offt, unsigned int len) {
+  int ret = 0;
+  unsigned int i = offt;
+  unsigned int n;
+  if (i2c_set_bus_num(CONFIG_SYS_OEM_BUS_NUM)) {
+		return -1;
+  }
+
+  while (i<offt+len) {
+    n = ((offt+len-i)>fru_read_chunk?fru_read_chunk:(offt+len-i));
+    ret = i2c_read(CONFIG_SYS_OEM_I2C_ADDR | 1, i, FRU_ADDR_SIZE, dst+(i-offt), n);
+    fru_trace(FRU_EV_READ, (n+FRU_PAGE_SIZE-1)/FRU_PAGE_SIZE, i, ret);
+    if (ret != 0) {
+      if (fru_read_chunk > FRU_PAGE_SIZE) {
+        /* controller rejected the long transfer, stick to pages from now on */
+        fwarn("FRU: sequential read of %i bytes failed [%i], using pages\n", n, ret);
+        fru_read_chunk = FRU_PAGE_SIZE;
+        continue;
       }
-      fru_dbg("%02x[%c] ", fru_buf[j], (fru_buf[j]>' '?fru_buf[j]:' '));
+      ferr("FRU: failed to read eeprom [%i]\n", ret);
+      return -1;
     }
-    fru_dbg("\n");
-#endif
+    i += n;
   }
   return 0;
 }
 
-int
-fru_update_mrec_eeprom(void) {
+static int
+read_fru(uint8_t *fru_buf) {
+  fru_dbg("Reading eeprom\n");
+  return read_fru_at(fru_buf, 0, FRU_SIZE);
+}
+
+static int
+write_fru_pages(uint8_t *buf, struct fru_write_cost *c) {
   int i = 0;
   int ret = 0;
-  memcpy(fru_buf2, fru_buf, fru.mrec_area_offset);
-  printf("Put multirecord area at %i\n", fru.mrec_area_offset);
-  ret = fru_mk_multirecords_area(&fru, fru_buf2+fru.mrec_area_offset, FRU_SIZE-fru.mrec_area_offset);
-  if (ret < 0) {
-    return -1;
-  }
-  flog("Writing eeprom ");
   if (i2c_set_bus_num(CONFIG_SYS_OEM_BUS_NUM)) {
 		return -2;
   }
 
-  for (i=0;i<FRU_SIZE;i+=32) {
-    ret = i2c_write(CONFIG_SYS_OEM_I2C_ADDR, i, 2, fru_buf2+i, 32);
+  for (i=0;i<FRU_SIZE;i+=FRU_PAGE_SIZE) {
+    if (!FRU_PAGE_DIRTY(c, i/FRU_PAGE_SIZE)) {
+      continue;
+    }
+    ret = i2c_write(CONFIG_SYS_OEM_I2C_ADDR, i, FRU_ADDR_SIZE, buf+i, FRU_PAGE_SIZE);
+    fru_trace(FRU_EV_WRITE, 0, i, ret);
     if (ret != 0) {
       ferr("FRU: failed to write eeprom [%i]\n", ret);
       return -3;
     }
-
-#ifdef FRU_DEBUG
-    int j;
-    for (j=i;j<32+i;j++) {
-      if ((j%8)==0) {
-        fru_dbg("\n");
-      }
-      fru_dbg("0x%02x[%c] ", fru_buf2[j], (fru_buf2[j]>' '?fru_buf2[j]:' '));
-    }
-    fru_dbg("\n");
-#else
     fmsg(".");
-#endif
     udelay(5000);
 
   }
@@ -589,43 +1455,831 @@ fru_update_mrec_eeprom(void) {
 }
 #endif
 
+static const struct fru_part *
+fru_find_part(void) {
+  unsigned int i = 0;
+  unsigned int size = fru_dev_size();
+  for (; i<sizeof(fru_parts)/sizeof(fru_parts[0]); i++) {
+    if (fru_parts[i].size == size) {
+      return &fru_parts[i];
+    }
+  }
+  return NULL;
+}
+
+static void
+fru_estimate_write(struct fru_write_cost *c) {
+  const struct fru_part *part = fru_find_part();
+  unsigned int t_wr_us = (part != NULL ? part->t_wr_us : fru_parts[0].t_wr_us);
+  /* device address, memory address and page data, 9 clocks per byte */
+  unsigned int bus_us = (1+FRU_ADDR_SIZE+FRU_PAGE_SIZE)*9*(1000000/FRU_I2C_HZ);
+
+  c->part = (part != NULL ? part->name : "unknown");
+  c->write_us = c->pages*(t_wr_us+bus_us);
+}
+
+static void
+fru_diff_image(uint8_t *old_buf, uint8_t *new_buf, struct fru_write_cost *c) {
+  unsigned int p;
+  unsigned int i;
+  bool dirty;
+
+  memset(c, 0, sizeof(struct fru_write_cost));
+  for (p=0; p<FRU_N_PAGES; p++) {
+    dirty = false;
+    for (i=p*FRU_PAGE_SIZE; i<(p+1)*FRU_PAGE_SIZE; i++) {
+      if (old_buf[i] == new_buf[i]) {
+        continue;
+      }
+      if (c->bytes_changed == 0) {
+        c->first_offset = i;
+      }
+      c->last_offset = i;
+      c->bytes_changed ++;
+      dirty = true;
+    }
+    if (dirty) {
+      c->page_map[p/8] |= (1<<(p%8));
+      c->pages ++;
+    }
+  }
+  c->bytes = c->pages*FRU_PAGE_SIZE;
+  fru_estimate_write(c);
+}
+
+static int
+fru_mk_image(struct fru *f, uint8_t *buf, uint8_t *base) {
+  unsigned int old_offset = f->mrec_area_offset;
+  unsigned int old_end = f->mrec_area_end;
+  unsigned int end;
+  int ret = 0;
+  /* keep everything outside of the rebuilt areas, so that only the pages
+     that really change differ */
+  memcpy(buf, base, FRU_SIZE);
+  if (f->areas_changed || f->mrec_area_offset == 0) {
+    if (f->areas_bad) {
+      fwarn("FRU: board or product area is damaged, not rebuilding\n");
+      return -1;
+    }
+    ret = fru_mk_areas(f, buf, FRU_SIZE, base);
+    if (ret < 0) {
+      fwarn("FRU: Failed to pack image [%i]\n", ret);
+      return -1;
+    }
+    end = ret;
+  } else {
+    fru_dbg("Put multirecord area at %i\n", f->mrec_area_offset);
+    ret = fru_mk_multirecords_area(f, buf+f->mrec_area_offset, fru_mrec_area_limit(base, FRU_SIZE)-f->mrec_area_offset);
+    if (ret < 0) {
+      fwarn("FRU: Failed to pack multirecord area\n");
+      return -1;
+    }
+    end = f->mrec_area_offset+ret;
+  }
+  /* blank what a shrunk area leaves behind, so that no complete old record
+     survives past the new end record; everything rebuilt lies below end */
+  if (end < old_offset) {
+    end = old_offset;
+  }
+  if (end < old_end) {
+    memset(buf+end, 0xff, old_end-end);
+  }
+  return 0;
+}
+
+static void
+fru_load_mrecs(struct fru *f) {
+  int i = 0;
+  f->mac0 = f->mac_data;
+  f->mac1 = f->mac_data+6;
+  f->mac2 = f->mac_data+12;
+  for (i=0; i<f->mrec_count; i++) {
+    if (f->mrec[i].data == NULL) {
+      continue;
+    } else if (f->mrec[i].type == MR_MAC_REC) {
+      memcpy(f->mac_data, f->mrec[i].data, 6);
+      fru_dbg("FRU: found MAC mrec [%02x %02x %02x %02x %02x %02x]\n", f->mac_data[0], f->mac_data[1], f->mac_data[2], f->mac_data[3], f->mac_data[4], f->mac_data[5]);
+    } else if (f->mrec[i].type == MR_MAC2_REC) {
+      memcpy(f->mac_data+6, f->mrec[i].data, 6);
+      fru_dbg("FRU: found MAC2 mrec [%02x %02x %02x %02x %02x %02x]\n", f->mac_data[6], f->mac_data[7], f->mac_data[8], f->mac_data[9], f->mac_data[10], f->mac_data[11]);
+    } else if (f->mrec[i].type == MR_MAC3_REC) {
+      memcpy(f->mac_data+12, f->mrec[i].data, 6);
+      fru_dbg("FRU: found MAC3 mrec [%02x %02x %02x %02x %02x %02x]\n", f->mac_data[12], f->mac_data[13], f->mac_data[14], f->mac_data[15], f->mac_data[16], f->mac_data[17]);
+    } else if (f->mrec[i].type == MR_SATADEV_REC) {
+      memset(f->bootdevice, 0, FRU_STR_MAX);
+      memcpy(f->bootdevice, f->mrec[i].data, (f->mrec[i].length>FRU_STR_MAX?FRU_STR_MAX:f->mrec[i].length));
+      fru_dbg("FRU: found SATA boot device [%s]\n", f->bootdevice);
+    } else if (f->mrec[i].type == MR_PASSWD_REC) {
+      memset(f->passwd_line, 0, FRU_PWD_MAX);
+      memcpy(f->passwd_line, f->mrec[i].data, (f->mrec[i].length>FRU_PWD_MAX?FRU_PWD_MAX:f->mrec[i].length));
+      fru_dbg("FRU: found passwd line [%s]\n", f->passwd_line);
+    } else if (f->mrec[i].type == MR_TESTOK_REC) {
+      f->test_ok = 0;
+      memcpy(&f->test_ok, f->mrec[i].data, 1);
+      fru_dbg("FRU: found test ok record [0x%02x]\n", f->test_ok);
+    } else if (f->mrec[i].type == MR_POWER_POLICY_REC) {
+      f->power_policy = 0;
+      memcpy(&f->power_policy, f->mrec[i].data, 1);
+      fru_dbg("FRU: found power policy record [0x%02x]\n", f->power_policy);
+    }
+  }
+}
+
+/* Read back each run of consecutive written pages in one transfer, rewrite
+   the pages that do not match and count the retries per page */
+static int
+fru_verify_pages(uint8_t *buf, struct fru_write_cost *c) {
+  struct fru_write_cost todo;
+  struct fru_write_cost redo;
+  unsigned int p;
+  unsigned int end;
+  unsigned int bad;
+  int attempt = 0;
+
+  memcpy(todo.page_map, c->page_map, sizeof(todo.page_map));
+  for (;; attempt++) {
+    memset(redo.page_map, 0, sizeof(redo.page_map));
+    bad = 0;
+    for (p=0; p<FRU_N_PAGES; p=end) {
+      end = p+1;
+      if (!FRU_PAGE_DIRTY(&todo, p)) {
+        continue;
+      }
+      while (end<FRU_N_PAGES && FRU_PAGE_DIRTY(&todo, end)) {
+        end ++;
+      }
+      /* the readback lands in fru_buf, which is about to become the
+         reference image anyway */
+      if (read_fru_at(fru_buf+p*FRU_PAGE_SIZE, p*FRU_PAGE_SIZE, (end-p)*FRU_PAGE_SIZE) != 0) {
+        return -6;
+      }
+      for (; p<end; p++) {
+        if (memcmp(fru_buf+p*FRU_PAGE_SIZE, buf+p*FRU_PAGE_SIZE, FRU_PAGE_SIZE) != 0) {
+          redo.page_map[p/8] |= (1<<(p%8));
+          bad ++;
+        }
+      }
+    }
+    if (bad == 0) {
+      return 0;
+    }
+    if (attempt >= FRU_WRITE_RETRIES) {
+      ferr("FRU: %i pages still differ after %i rewrites\n", bad, attempt);
+      return -6;
+    }
+    for (p=0; p<FRU_N_PAGES; p++) {
+      if (FRU_PAGE_DIRTY(&redo, p)) {
+        fwarn("FRU: page %i verify failed, rewriting\n", p);
+        fru_trace(FRU_EV_VERIFY, 0, p*FRU_PAGE_SIZE, attempt+1);
+        c->retries[p] ++;
+        c->rewrites ++;
+      }
+    }
+    if (write_fru_pages(buf, &redo) < 0) {
+      return -3;
+    }
+    memcpy(todo.page_map, redo.page_map, sizeof(todo.page_map));
+  }
+}
+
+static int
+fru_flush_image(struct fru_write_cost *cost, bool dry_run) {
+  int ret = 0;
+  fru_diff_image(fru_buf, fru_buf2, cost);
+  flog("Image differs in %i bytes, %i pages to write, ~%i us on %s\n", cost->bytes_changed, cost->pages, cost->write_us, cost->part);
+  if (dry_run || cost->pages == 0) {
+    return 0;
+  }
+  flog("Writing eeprom ");
+  fru_cache_valid = false;
+  ret = write_fru_pages(fru_buf2, cost);
+  if (ret == 0) {
+    ret = fru_verify_pages(fru_buf2, cost);
+  }
+  if (ret < 0) {
+    /* the EEPROM no longer matches fru_buf; reload whatever it holds now */
+    if (read_fru(fru_buf) == 0 && parse_fru(&fru, fru_buf, FRU_SIZE) == 0) {
+      fru_load_mrecs(&fru);
+    }
+    return ret;
+  }
+  /* the written image becomes the reference; records must point into it */
+  memcpy(fru_buf, fru_buf2, FRU_SIZE);
+  if (parse_fru(&fru, fru_buf, FRU_SIZE) != 0) {
+    return -4;
+  }
+  fru_load_mrecs(&fru);
+  fru.areas_changed = false;
+  /* fru_buf now holds the verified image, no need to read it back again */
+  fru_cache_ret = 0;
+  fru_cache_valid = true;
+  return 0;
+}
+
+static int
+fru_write_image(struct fru *f, struct fru_write_cost *cost, bool dry_run) {
+  if (fru_mk_image(f, fru_buf2, fru_buf) < 0) {
+    return -1;
+  }
+  return fru_flush_image(cost, dry_run);
+}
+
+int
+fru_update_mrec_eeprom(void) {
+  struct fru_write_cost cost;
+  int ret = 0;
+  if (fru_lock(true) != 0) {
+    return -5;
+  }
+  ret = fru_write_image(&fru, &cost, false);
+  fru_unlock();
+  return ret;
+}
+
+static int
+fru_read_parse(struct fru *f) {
+  int ret = 0;
+#ifdef RECOVERY
+  int i = 0;
+  /* another writer may have been caught mid-update, read again */
+  for (; i<FRU_READ_RETRIES; i++) {
+    if (read_fru(fru_buf) != 0) {
+      return -1;
+    }
+    ret = parse_fru(f, fru_buf, FRU_SIZE);
+    /* an empty part will not become valid by reading it again */
+    if (ret == 0 || ret == -2) {
+      break;
+    }
+    fwarn("FRU: parse failed [%i], retrying read\n", ret);
+    fru_retry_delay();
+  }
+#else
+  /* nothing else writes the part while the bootloader runs, a bad image
+     stays bad and the boot path reads it only once */
+  if (read_fru(fru_buf) != 0) {
+    return -1;
+  }
+  ret = parse_fru(f, fru_buf, FRU_SIZE);
+#endif
+  if (ret != 0) {
+    return -2;
+  }
+  fru_load_mrecs(f);
+  return 0;
+}
+
+struct fru *
+fru_edit_begin(void) {
+  if (fru_in_edit) {
+    fwarn("FRU: an edit is already in progress\n");
+    return NULL;
+  }
+  if (fru_lock(true) != 0) {
+    return NULL;
+  }
+  /* take the reference image under the exclusive lock, so that no other
+     writer can slip in between this read and the commit */
+  if (fru_open_parse() != 0) {
+    ferr("FRU: no valid image to edit\n");
+    fru_unlock();
+    return NULL;
+  }
+  memcpy(&fru_stage, &fru, sizeof(struct fru));
+  /* the copied pointers still point into fru */
+  fru_stage.mac0 = fru_stage.mac_data;
+  fru_stage.mac1 = fru_stage.mac_data+6;
+  fru_stage.mac2 = fru_stage.mac_data+12;
+  fru_in_edit = true;
+  return &fru_stage;
+}
+
+/* Like fru_edit_begin(), but the staged copy starts out empty; whatever the
+   part holds is only the base the new image is diffed against */
+struct fru *
+fru_edit_new(void) {
+  if (fru_in_edit) {
+    fwarn("FRU: an edit is already in progress\n");
+    return NULL;
+  }
+  if (fru_lock(true) != 0) {
+    return NULL;
+  }
+  fru_cache_valid = false;
+  if (read_fru(fru_buf) != 0) {
+    fru_unlock();
+    return NULL;
+  }
+  fru_init(&fru_stage);
+  fru_in_edit = true;
+  return &fru_stage;
+}
+
+void
+fru_edit_abort(void) {
+  if (fru_in_edit) {
+    fru_in_edit = false;
+    fru_unlock();
+  }
+}
+
+int
+fru_edit_commit(struct fru_write_cost *cost, bool dry_run) {
+  struct fru_write_cost c;
+  int ret = 0;
+  if (!fru_in_edit) {
+    fwarn("FRU: no edit in progress\n");
+    return -1;
+  }
+  ret = fru_write_image(&fru_stage, (cost != NULL ? cost : &c), dry_run);
+  /* once anything went to the EEPROM the staged copy is stale */
+  if (!dry_run && ret != -1) {
+    fru_in_edit = false;
+    fru_unlock();
+  }
+  return ret;
+}
+
+void
+fru_set_tolerant(bool on) {
+  fru_tolerant = on;
+}
+
+/* A damaged record becomes an MR_VOID_REC over the bytes it already
+   occupies, so every later record keeps its offset and only the pages
+   holding damaged headers change */
+static unsigned int
+fru_void_damaged(struct fru *f) {
+  struct multirec *m;
+  unsigned int end;
+  unsigned int n = 0;
+  int i = 0;
+
+  for (; i<f->mrec_count; i++) {
+    m = &f->mrec[i];
+    if (m->data != NULL) {
+      continue;
+    }
+    end = (i+1 < f->mrec_count ? f->mrec[i+1].offset : f->mrec_area_end);
+    if (end < m->offset+5) {
+      fwarn("FRU: no room to void [%02x] at %i, repacking the area\n", m->type, m->offset);
+      continue;
+    }
+    flog("Voiding damaged [%02x] at %i\n", m->type, m->offset);
+    m->type = MR_VOID_REC;
+    m->format = 2;
+    m->length = end-m->offset-5;
+    m->data = fru_buf+m->offset+5;
+    n ++;
+  }
+  return n;
+}
+
+int
+fru_repair(struct fru_write_cost *cost, bool dry_run) {
+  struct fru *f;
+  bool tolerant = fru_tolerant;
+  int ret = 0;
+
+  /* stays on until the commit has parsed back what it wrote, which still
+     carries any damaged board or product area */
+  fru_tolerant = true;
+  /* parse the part again, tolerantly, whatever was cached before */
+  fru_cache_valid = false;
+  f = fru_edit_begin();
+  if (f == NULL) {
+    fru_tolerant = tolerant;
+    if (fru_cache_ret == -2) {
+      fwarn("FRU: image is beyond multirecord repair\n");
+      return -2;
+    }
+    return -1;
+  }
+  if (f->mrec_bad == 0) {
+    flog("No damaged multirecords\n");
+    if (cost != NULL) {
+      /* nothing to write, but still tell which part was looked at */
+      fru_diff_image(fru_buf, fru_buf, cost);
+    }
+    fru_edit_abort();
+    fru_tolerant = tolerant;
+    return 0;
+  }
+  flog("Voided %i of %i damaged multirecords in place\n", fru_void_damaged(f), f->mrec_bad);
+  ret = fru_edit_commit(cost, dry_run);
+  fru_edit_abort();
+  fru_tolerant = tolerant;
+  return ret;
+}
+
+struct fru *
+fru_parsed(void) {
+  return &fru;
+}
+
 int
 fru_open_parse(void) {
+#ifndef RECOVERY
+  /* nothing but the bootloader writes the part while it runs, so the image
+     is parsed once per boot and only a commit drops the cached copy */
+  if (fru_cache_valid) {
+    return fru_cache_ret;
+  }
+#endif
+  fru_cache_ret = fru_read_parse(&fru);
+  /* a failed transfer is worth retrying, a bad image is not */
+  fru_cache_valid = (fru_cache_ret != -1);
+  return fru_cache_ret;
+}
+
+#ifndef RECOVERY
+/* Export the MACs and the boot device to the environment in one pass,
+   leaving variables that are already set alone */
+int
+fru_env_export(void) {
+  static const char *mac_env[N_MAC] = {"ethaddr", "eth1addr", "eth2addr"};
   int i = 0;
-  fru.mac0 = fru.mac_data;
-  fru.mac1 = fru.mac_data+6;
-  fru.mac2 = fru.mac_data+12;
-  read_fru(fru_buf);
-  if (parse_fru(&fru, fru_buf, FRU_SIZE) != 0) {
+  if (fru_open_parse() != 0) {
+    return -1;
+  }
+  for (; i<N_MAC; i++) {
+    if (is_valid_ether_addr(fru.mac_data+i*6) && getenv(mac_env[i]) == NULL) {
+      eth_setenv_enetaddr(mac_env[i], fru.mac_data+i*6);
+    }
+  }
+  if (fru.bootdevice[0] != 0 && getenv("bootdevice") == NULL) {
+    setenv("bootdevice", (char *)fru.bootdevice);
+  }
+  return 0;
+}
+#endif
+
+/* Streaming parser: walks the EEPROM through a single FRU_PAGE_SIZE window
+   and touches neither fru_buf, fru_buf2 nor struct fru, so a stage that
+   only calls fru_stream_* links none of them with --gc-sections. */
+struct fru_win {
+  uint8_t buf[FRU_PAGE_SIZE];
+  int page;
+  unsigned int *pages_read;
+};
+
+static int
+fru_win_byte(struct fru_win *w, unsigned int offt) {
+  int page = offt/FRU_PAGE_SIZE;
+  if (offt >= FRU_SIZE) {
+    return -1;
+  }
+  if (page != w->page) {
+    if (read_fru_at(w->buf, page*FRU_PAGE_SIZE, FRU_PAGE_SIZE) != 0) {
+      return -1;
+    }
+    w->page = page;
+    (*w->pages_read) ++;
+  }
+  return w->buf[offt%FRU_PAGE_SIZE];
+}
+
+static struct fru_stream_req *
+fru_stream_find(struct fru_stream *s, uint8_t area, uint8_t id) {
+  unsigned int i = 0;
+  for (; i<s->n_req; i++) {
+    if (s->req[i].area == area && s->req[i].id == id && !s->req[i].found) {
+      return &s->req[i];
+    }
+  }
+  return NULL;
+}
+
+static bool
+fru_stream_wants(struct fru_stream *s, uint8_t area) {
+  unsigned int i = 0;
+  for (; i<s->n_req; i++) {
+    if (s->req[i].area == area && !s->req[i].found) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+fru_stream_init(struct fru_stream *s) {
+  memset(s, 0, sizeof(struct fru_stream));
+}
+
+int
+fru_stream_want(struct fru_stream *s, uint8_t area, uint8_t id, uint8_t *buf, unsigned int size) {
+  struct fru_stream_req *r;
+  if (s->n_req >= FRU_STREAM_MAX || size == 0) {
+    return -1;
+  }
+  r = &s->req[s->n_req++];
+  r->area = area;
+  r->id = id;
+  r->buf = buf;
+  r->size = size;
+  r->len = 0;
+  r->found = false;
+  return 0;
+}
+
+/* The whole area has to pass through the window for its checksum, fields
+   of interest are decoded on the way and dropped again if it fails */
+static int
+fru_stream_area(struct fru_stream *s, struct fru_win *w, uint8_t area, unsigned int start) {
+  struct fru_stream_req *r = NULL;
+  uint8_t raw[0x3f];
+  unsigned int raw_n = 0;
+  unsigned int next = (area == FRU_AREA_BOARD ? 6 : 3);
+  unsigned int field = 0;
+  unsigned int len;
+  unsigned int i = 0;
+  uint8_t tl = 0;
+  uint8_t cs = 0;
+  int b;
+
+  b = fru_win_byte(w, start+1);
+  if (b < 0) {
+    return -1;
+  }
+  len = b*8;
+  for (; i<len; i++) {
+    b = fru_win_byte(w, start+i);
+    if (b < 0) {
+      return -1;
+    }
+    cs += b;
+    if (i == 0 && b != BOARD_AREA_VERSION) {
+      fwarn("FRU: area at %i version is not valid\n", start);
+      return -2;
+    }
+    if (i == next) {
+      if (b == FRU_END_OF_FIELDS) {
+        next = len;
+        continue;
+      }
+      tl = b;
+      raw_n = 0;
+      next = i+1+(tl&0x3f);
+      r = fru_stream_find(s, area, field++);
+    } else if (r != NULL && i < next) {
+      raw[raw_n++] = b;
+    }
+    if (r != NULL && i+1 == next) {
+      memset(r->buf, 0, r->size);
+      r->len = fru_decode_str(tl>>6, raw, raw_n, r->buf, r->size-1);
+      r->found = true;
+      r = NULL;
+    }
+  }
+  if (cs != 0) {
+    fwarn("FRU: Bad area checksum at %i\n", start);
+    for (i=0; i<s->n_req; i++) {
+      if (s->req[i].area == area) {
+        memset(s->req[i].buf, 0, s->req[i].size);
+        s->req[i].found = false;
+        s->req[i].len = 0;
+      }
+    }
+    return -2;
+  }
+  return 0;
+}
+
+/* Records nobody asked for are skipped by their header alone */
+static int
+fru_stream_mrecs(struct fru_stream *s, struct fru_win *w, unsigned int offt) {
+  struct fru_stream_req *r;
+  uint8_t hdr[5];
+  uint8_t cs;
+  unsigned int i;
+  bool end = false;
+  int b;
+
+  while (!end && fru_stream_wants(s, FRU_AREA_MREC)) {
+    cs = 0;
+    for (i=0; i<5; i++) {
+      b = fru_win_byte(w, offt+i);
+      if (b < 0) {
+        return -1;
+      }
+      hdr[i] = b;
+      cs += b;
+    }
+    if (cs != 0 || (hdr[1]&0x7) != 0x2) {
+      fwarn("FRU: multirecord header at %i is invalid\n", offt);
+      return -3;
+    }
+    end = (hdr[1]&0x80?true:false);
+    r = fru_stream_find(s, FRU_AREA_MREC, hdr[0]);
+    if (r != NULL) {
+      cs = hdr[3];
+      for (i=0; i<hdr[2]; i++) {
+        b = fru_win_byte(w, offt+5+i);
+        if (b < 0) {
+          return -1;
+        }
+        cs += b;
+        if (i < r->size) {
+          r->buf[i] = b;
+        }
+      }
+      if (cs != 0) {
+        fwarn("FRU: multirecord data checksum at %i is invalid\n", offt);
+      } else {
+        r->len = (hdr[2]<r->size?hdr[2]:r->size);
+        r->found = true;
+      }
+    }
+    offt += 5+hdr[2];
+  }
+  return 0;
+}
+
+int
+fru_stream_parse(struct fru_stream *s) {
+  struct fru_win w;
+  uint8_t hdr[8];
+  uint8_t cs = 0;
+  unsigned int i = 0;
+  int found = 0;
+  int b;
+
+  w.page = -1;
+  w.pages_read = &s->pages_read;
+  s->pages_read = 0;
+  for (; i<8; i++) {
+    b = fru_win_byte(&w, i);
+    if (b < 0) {
+      return -1;
+    }
+    hdr[i] = b;
+    cs += b;
+  }
+  if (hdr[0] == 0xff) {
+    fwarn("FRU: Empty EEPROM detected\n");
     return -2;
+  } else if (hdr[0] != FRU_VERSION) {
+    fwarn("FRU: Header version is not valid\n");
+    return -3;
+  } else if (cs != 0) {
+    fwarn("FRU: Bad header checksum: %i\n", cs);
+    return -4;
   }
-  for (i=0; i<fru.mrec_count; i++) {
-    if (fru.mrec[i].type == MR_MAC_REC) {
-      memcpy(fru.mac_data, fru.mrec[i].data, 6);
-      fru_dbg("FRU: found MAC mrec [%02x %02x %02x %02x %02x %02x]\n", fru.mac_data[0], fru.mac_data[1], fru.mac_data[2], fru.mac_data[3], fru.mac_data[4], fru.mac_data[5]);
-    } else if (fru.mrec[i].type == MR_MAC2_REC) {
-      memcpy(fru.mac_data+6, fru.mrec[i].data, 6);
-      fru_dbg("FRU: found MAC2 mrec [%02x %02x %02x %02x %02x %02x]\n", fru.mac_data[6], fru.mac_data[7], fru.mac_data[8], fru.mac_data[9], fru.mac_data[10], fru.mac_data[11]);
-    } else if (fru.mrec[i].type == MR_MAC3_REC) {
-      memcpy(fru.mac_data+12, fru.mrec[i].data, 6);
-      fru_dbg("FRU: found MAC3 mrec [%02x %02x %02x %02x %02x %02x]\n", fru.mac_data[12], fru.mac_data[13], fru.mac_data[14], fru.mac_data[15], fru.mac_data[16], fru.mac_data[17]);
-    } else if (fru.mrec[i].type == MR_SATADEV_REC) {
-      memset(fru.bootdevice, 0, FRU_STR_MAX);
-      memcpy(fru.bootdevice, fru.mrec[i].data, (fru.mrec[i].length>FRU_STR_MAX?FRU_STR_MAX:fru.mrec[i].length));
-      fru_dbg("FRU: found SATA boot device [%s]\n", fru.bootdevice);
-    } else if (fru.mrec[i].type == MR_PASSWD_REC) {
-      memset(fru.passwd_line, 0, FRU_PWD_MAX);
-      memcpy(fru.passwd_line, fru.mrec[i].data, (fru.mrec[i].length>FRU_PWD_MAX?FRU_PWD_MAX:fru.mrec[i].length));
-      fru_dbg("FRU: found passwd line [%s]\n", fru.passwd_line);
-    } else if (fru.mrec[i].type == MR_TESTOK_REC) {
-      fru.test_ok = 0;
-      memcpy(&fru.test_ok, fru.mrec[i].data, 1);
-      fru_dbg("FRU: found test ok record [0x%02x]\n", fru.test_ok);
-    } else if (fru.mrec[i].type == MR_POWER_POLICY_REC) {
-      fru.power_policy = 0;
-      memcpy(&fru.power_policy, fru.mrec[i].data, 1);
-      fru_dbg("FRU: found power policy record [0x%02x]\n", fru.power_policy);
+  if (hdr[3] != 0 && fru_stream_wants(s, FRU_AREA_BOARD)) {
+    if (fru_stream_area(s, &w, FRU_AREA_BOARD, hdr[3]*8) == -1) {
+      return -1;
+    }
+  }
+  if (hdr[4] != 0 && fru_stream_wants(s, FRU_AREA_PRODUCT)) {
+    if (fru_stream_area(s, &w, FRU_AREA_PRODUCT, hdr[4]*8) == -1) {
+      return -1;
     }
   }
+  if (hdr[5] != 0 && fru_stream_wants(s, FRU_AREA_MREC)) {
+    if (fru_stream_mrecs(s, &w, hdr[5]*8) == -1) {
+      return -1;
+    }
+  }
+  for (i=0; i<s->n_req; i++) {
+    if (s->req[i].found) {
+      found ++;
+    }
+  }
+  return found;
+}
+
+#ifdef RECOVERY
+#define FRU_BACKUP_MAGIC   "MFRU"
+#define FRU_BACKUP_VERSION 1
+#define FRU_BACKUP_HDR     64
+#define FRU_BACKUP_VALID   (1<<0)
+
+static uint32_t
+fru_crc32(uint8_t *buf, unsigned int len) {
+  uint32_t crc = 0xffffffff;
+  unsigned int i = 0;
+  int b;
+  for (; i<len; i++) {
+    crc ^= buf[i];
+    for (b=0; b<8; b++) {
+      crc = (crc>>1) ^ (0xedb88320 & (0-(crc&1)));
+    }
+  }
+  return ~crc;
+}
+
+static void
+fru_put_le(uint8_t *buf, uint32_t val, int len) {
+  int i = 0;
+  for (; i<len; i++) {
+    buf[i] = (val>>(8*i))&0xff;
+  }
+}
+
+static uint32_t
+fru_get_le(uint8_t *buf, int len) {
+  uint32_t val = 0;
+  int i = len-1;
+  for (; i>=0; i--) {
+    val = (val<<8) | buf[i];
+  }
+  return val;
+}
+
+/* Backup file: 64 byte little endian header followed by the raw image.
+   0 magic, 4 version, 6 page size, 8 image size, 12 image crc32,
+   16 unix time, 20 flags, 24 part name, 32 board serial number */
+int
+fru_backup(const char *path) {
+  uint8_t hdr[FRU_BACKUP_HDR];
+  const struct fru_part *part = fru_find_part();
+  FILE *f = NULL;
+  uint32_t flags = 0;
+
+  if (fru_in_edit) {
+    fwarn("FRU: edit in progress, not backing up\n");
+    return -1;
+  }
+  if (read_fru(fru_buf2) != 0) {
+    return -1;
+  }
+  memset(hdr, 0, sizeof(hdr));
+  if (parse_fru(&fru_stage, fru_buf2, FRU_SIZE) == 0) {
+    flags |= FRU_BACKUP_VALID;
+    memcpy(hdr+32, fru_stage.val_serial_number, FRU_STR_MAX);
+  } else {
+    fwarn("FRU: backing up an image that does not parse\n");
+  }
+  memcpy(hdr, FRU_BACKUP_MAGIC, 4);
+  fru_put_le(hdr+4, FRU_BACKUP_VERSION, 2);
+  fru_put_le(hdr+6, FRU_PAGE_SIZE, 2);
+  fru_put_le(hdr+8, FRU_SIZE, 4);
+  fru_put_le(hdr+12, fru_crc32(fru_buf2, FRU_SIZE), 4);
+  fru_put_le(hdr+16, time(NULL), 4);
+  fru_put_le(hdr+20, flags, 4);
+  strncpy((char *)hdr+24, (part != NULL ? part->name : "unknown"), 8);
+
+  f = fopen(path, "w");
+  if (f == NULL) {
+    ferr("FRU: failed to open %s\n", path);
+    return -2;
+  }
+  if (fwrite(hdr, sizeof(uint8_t), FRU_BACKUP_HDR, f) != FRU_BACKUP_HDR ||
+      fwrite(fru_buf2, sizeof(uint8_t), FRU_SIZE, f) != FRU_SIZE) {
+    ferr("FRU: failed to write %s\n", path);
+    fclose(f);
+    return -3;
+  }
+  if (fclose(f) != 0) {
+    ferr("FRU: failed to write %s\n", path);
+    return -3;
+  }
+  flog("Saved %i byte image to %s\n", FRU_SIZE, path);
   return 0;
 }
+
+int
+fru_restore(const char *path, struct fru_write_cost *cost, bool dry_run) {
+  uint8_t hdr[FRU_BACKUP_HDR];
+  FILE *f = NULL;
+  int ret = 0;
+
+  if (fru_in_edit) {
+    fwarn("FRU: edit in progress, not restoring\n");
+    return -1;
+  }
+  f = fopen(path, "r");
+  if (f == NULL) {
+    ferr("FRU: failed to open %s\n", path);
+    return -2;
+  }
+  if (fread(hdr, sizeof(uint8_t), FRU_BACKUP_HDR, f) != FRU_BACKUP_HDR ||
+      memcmp(hdr, FRU_BACKUP_MAGIC, 4) != 0 ||
+      fru_get_le(hdr+4, 2) != FRU_BACKUP_VERSION ||
+      fru_get_le(hdr+8, 4) != FRU_SIZE ||
+      fread(fru_buf2, sizeof(uint8_t), FRU_SIZE, f) != FRU_SIZE) {
+    ferr("FRU: %s is not a FRU backup\n", path);
+    fclose(f);
+    return -3;
+  }
+  fclose(f);
+  if (fru_crc32(fru_buf2, FRU_SIZE) != fru_get_le(hdr+12, 4)) {
+    ferr("FRU: %s checksum mismatch\n", path);
+    return -3;
+  }
+  if (parse_fru(&fru_stage, fru_buf2, FRU_SIZE) != 0) {
+    ferr("FRU: %s does not hold a valid image\n", path);
+    return -4;
+  }
+  if (fru_lock(true) != 0) {
+    return -5;
+  }
+  /* diff against what the part holds now, not what was parsed earlier */
+  ret = read_fru(fru_buf);
+  if (ret == 0) {
+    ret = fru_flush_image(cost, dry_run);
+  }
+  fru_unlock();
+  return ret;
+}
+#endif
@@ -1,10 +1,11 @@
 #ifndef __FRU_H__
 #define __FRU_H__
 
-#ifdef RECOVERY
+/* In U-Boot the fixed width types come from <common.h>, which has to be
+   included first; the C library ones would clash with them */
+#ifndef __UBOOT__
 #include <stdint.h>
-#else
-#include <common.h>
+#include <stdarg.h>
 #endif
 #include <stdbool.h>
 
@@ -16,10 +17,14 @@
 #define MR_POWER_STATE_REC  0xC5
 #define MR_MAC2_REC         0xC6
 #define MR_MAC3_REC         0xC7
+/* left by a repair where a damaged record used to be */
+#define MR_VOID_REC         0xCF
 
 #define FRU_ADDR      0xa6
 #define FRU_PAGE_SIZE 32
 #define FRU_ADDR_SIZE 2
+#define FRU_SIZE      4096
+#define FRU_N_PAGES   (FRU_SIZE/FRU_PAGE_SIZE)
 
 #define FRU_STR_MAX 32
 #define FRU_PWD_MAX 128
@@ -27,6 +32,11 @@
 
 #define N_MAC 3
 
+#define FRU_READ_RETRIES   3
+#define FRU_RETRY_DELAY_MS 10
+#define FRU_WRITE_RETRIES  3
+#define FRU_N_FIELDS 12
+
 #define FRU_STR(name, len) unsigned int len_##name; uint8_t val_##name[len]
 
 enum POWER_POLICY {
@@ -36,6 +46,10 @@ enum POWER_POLICY {
   PP_NUM
 };
 
+/* The structures below are part of the libmitxfru.so.1 ABI: their layout
+   is frozen, new members only ever come out of the reserved space */
+
+/* Damaged records kept by a tolerant parse have data set to NULL */
 struct multirec {
   uint8_t type;
   uint8_t format;
@@ -43,6 +57,7 @@ struct multirec {
   unsigned int length;
   bool header_cs_ok;
   bool cs_ok;
+  unsigned int offset;
   uint8_t *data;
 };
 
@@ -60,6 +75,10 @@ struct fru {
   unsigned int board_area_offset;
   unsigned int product_area_offset;
   unsigned int mrec_area_offset;
+  unsigned int internal_area_offset;
+  unsigned int chassis_area_offset;
+  unsigned int internal_area_end;
+  unsigned int mrec_area_end;
   FRU_STR(mfg_name, FRU_STR_MAX);
   FRU_STR(product_name, FRU_STR_MAX);
   FRU_STR(serial_number, FRU_STR_MAX);
@@ -74,11 +93,94 @@ struct fru {
   FRU_STR(p_fru_id, FRU_STR_MAX);
   struct multirec mrec[N_MULTIREC];
   unsigned int mrec_count;
+  unsigned int mrec_bad;
+  bool areas_bad;
+  bool areas_changed;
+  uint32_t fields_changed;
+  uint32_t fields_truncated;
+  unsigned int chassis_area_end;
+  uint32_t reserved[5];
+};
+
+/* Result of comparing a freshly built image against the EEPROM contents */
+struct fru_write_cost {
+  uint8_t page_map[(FRU_N_PAGES+7)/8];
+  unsigned int pages;
+  unsigned int bytes;
+  unsigned int bytes_changed;
+  unsigned int first_offset;
+  unsigned int last_offset;
+  const char *part;
+  unsigned int write_us;
+  uint8_t retries[FRU_N_PAGES];
+  unsigned int rewrites;
+  uint32_t reserved[4];
+};
+
+enum FRU_TRACE_EV {
+  FRU_EV_READ=1,
+  FRU_EV_WRITE,
+  FRU_EV_VERIFY,
+  FRU_EV_AREA,
+  FRU_EV_CS,
+  FRU_EV_MREC,
+  FRU_EV_LOCK
+};
+
+#define FRU_AREA_HEADER  0
+#define FRU_AREA_BOARD   1
+#define FRU_AREA_PRODUCT 2
+#define FRU_AREA_MREC    3
+
+struct fru_trace_ev {
+  uint32_t ts_us;
+  uint16_t offt;
+  int16_t val;
+  uint8_t type;
+  uint8_t arg;
 };
 
+#define FRU_STREAM_MAX 4
+
+/* A field the streaming parser should extract: a board or product area
+   field by index, or a multirecord by type */
+struct fru_stream_req {
+  uint8_t area;
+  uint8_t id;
+  uint8_t *buf;
+  unsigned int size;
+  unsigned int len;
+  bool found;
+};
+
+struct fru_stream {
+  struct fru_stream_req req[FRU_STREAM_MAX];
+  unsigned int n_req;
+  unsigned int pages_read;
+};
+
+#define FRU_PAGE_DIRTY(c, p) ((c)->page_map[(p)/8] & (1<<((p)%8)))
+
+enum FRU_LOG_LEVEL {
+  FRU_LOG_MSG=0,
+  FRU_LOG_INFO,
+  FRU_LOG_WARN,
+  FRU_LOG_ERR,
+  FRU_LOG_DEBUG
+};
+
+/* Library messages are dropped unless a log callback is installed */
+typedef void (*fru_log_fn)(enum FRU_LOG_LEVEL level, const char *fmt, va_list ap);
+
+/* Bootloader code may keep using the parsed image directly; libmitxfru.so
+   does not export it, use fru_parsed() there */
 extern struct fru fru;
+
+/* libmitxfru.so is built with -fvisibility=hidden, only what is declared
+   here is exported from it */
+#pragma GCC visibility push(default)
 int fru_open_parse(void);
-int fru_update_mac(uint8_t *mac, int iface);
+struct fru *fru_parsed(void);
 int fru_update_mrec_eeprom(void);
 int fru_mrec_update_mac(struct fru *f, uint8_t *mac, int iface);
 int fru_mrec_update_bootdevice(struct fru *f, uint8_t *bootdevice);
@@ -86,10 +188,34 @@ int fru_mrec_update_passwd_line(struct fru *f, uint8_t *passwd_line);
 int fru_mrec_update_test_ok(struct fru *f, uint8_t test_ok);
 int fru_mrec_update_power_policy(struct fru *f, enum POWER_POLICY pp);
 int fru_mrec_update_power_state(struct fru *f);
-void print_board_area(struct fru *f);
-void print_product_area(struct fru *f);
+struct fru *fru_edit_begin(void);
+struct fru *fru_edit_new(void);
+int fru_edit_commit(struct fru_write_cost *cost, bool dry_run);
+void fru_edit_abort(void);
+void fru_set_tolerant(bool on);
+int fru_repair(struct fru_write_cost *cost, bool dry_run);
+void fru_init(struct fru *f);
+int fru_set_field(struct fru *f, const char *name, const char *val);
+const uint8_t *fru_get_field(struct fru *f, const char *name);
+int fru_mrec_get(struct fru *f, uint8_t type, uint8_t **data, unsigned int *len);
+int fru_mk_board_area(struct fru *f, uint8_t *buf, unsigned int buf_len);
+int fru_mk_product_area(struct fru *f, uint8_t *buf, unsigned int buf_len);
+int fru_mk_full_image(struct fru *f, uint8_t *buf, unsigned int buf_len);
+void fru_stream_init(struct fru_stream *s);
+int fru_stream_want(struct fru_stream *s, uint8_t area, uint8_t id, uint8_t *buf, unsigned int size);
+int fru_stream_parse(struct fru_stream *s);
+void fru_trace_enable(bool on);
+unsigned int fru_trace_read(unsigned int first, struct fru_trace_ev *ev, unsigned int max);
+int fru_trace_format(struct fru_trace_ev *ev, char *buf, unsigned int len);
 
-#ifdef RECOVERY
+#ifdef __UBOOT__
+int fru_env_export(void);
+#else
+void fru_set_log(fru_log_fn fn);
+unsigned long fru_lock_wait_us(void);
+int fru_backup(const char *path);
+int fru_restore(const char *path, struct fru_write_cost *cost, bool dry_run);
 #endif
+#pragma GCC visibility pop
 
 #endif/*__FRU_H__*/
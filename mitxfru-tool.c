@@ -2,9 +2,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <getopt.h>
 #include "fru.h"
 #include "common.h"
 
@@ -15,28 +17,94 @@ static const char usage[] = "  -q : quite; dont print anything unrelated to what
   "  -g : get multirecord by hex id\n"
   "  -s : set multirecord by hex id, requires -d option to be filled with some data\n"
   "  -d : multirecord data to set; for use with -s option\n"
-  "  -r : display FRU information\n";
+  "  -f : set board or product area field, as name=value with names as printed by -r; may be repeated\n"
+  "  -i : initialize; build a new image instead of updating the EEPROM contents\n"
+  "  -n : dry run; with -s, -f, -p or -R, report what would be written instead of writing\n"
+  "  -r : display FRU information\n"
+  "  -b : save a backup of the raw EEPROM image to the given file\n"
+  "  -R : restore the EEPROM from the given backup file, writing only pages that differ\n"
+  "  -x : tolerate damaged multirecords instead of failing\n"
+  "  -p : repair; void damaged multirecords in place, rewriting only the pages that change\n"
+  "  --trace-dump : record EEPROM access trace and print it on exit\n";
+
+static const struct option long_options[] = {
+  {"trace-dump", no_argument, NULL, 'T'},
+  {NULL, 0, NULL, 0}
+};
 
 bool qflag = false;
 
+/* Printed here rather than through the library log, so that -q still
+   shows the trace */
+static void
+tool_trace_dump(void) {
+  struct fru_trace_ev ev[16];
+  char line[80];
+  unsigned int first = 0;
+  unsigned int n;
+  unsigned int i;
+  while ((n = fru_trace_read(first, ev, 16)) > 0) {
+    for (i=0; i<n; i++) {
+      fru_trace_format(&ev[i], line, sizeof(line));
+      printf("%s\n", line);
+    }
+    first += n;
+  }
+}
+
+static void
+print_cost(struct fru_write_cost *cost) {
+  int i = 0;
+  printf("part, %s\n", cost->part);
+  printf("bytes_changed, %u\n", cost->bytes_changed);
+  printf("bytes_written, %u\n", cost->bytes);
+  printf("write_us, %u\n", cost->write_us);
+  printf("pages,");
+  for (;i<FRU_N_PAGES;i++) {
+    if (FRU_PAGE_DIRTY(cost, i)) {
+      printf(" %i", i);
+    }
+  }
+  printf("\n");
+}
+
+static void
+tool_log(enum FRU_LOG_LEVEL level, const char *fmt, va_list ap) {
+  if (!qflag) {
+    vprintf(fmt, ap);
+  }
+}
+
 int
 main (int argc, char **argv) {
   bool hflag = false;
   bool rflag = false;
+  bool nflag = false;
+  bool iflag = false;
+  bool pflag = false;
+  char *fvalues[FRU_N_FIELDS];
+  int n_fields = 0;
+  char *eq;
   char *gvalue = NULL;
   char *svalue = NULL;
   char *dvalue = NULL;
+  char *bvalue = NULL;
+  char *Rvalue = NULL;
   uint32_t val;
   uint8_t mac[6];
+  unsigned int scan[6];
   uint8_t test_ok;
   uint8_t power_policy;
+  struct fru *f;
+  struct fru *parsed;
+  struct fru_write_cost cost;
   int c;
   int ret;
   int i = 0;
 
   opterr = 0;
 
-  while ((c = getopt (argc, argv, "rqhg:s:d:")) != -1) {
+  while ((c = getopt_long (argc, argv, "rqhnixpg:s:d:f:b:R:", long_options, NULL)) != -1) {
     switch (c) {
     case 'r':
       rflag = true;
@@ -47,6 +115,29 @@ main (int argc, char **argv) {
     case 'h':
       hflag = true;
       break;
+    case 'n':
+      nflag = true;
+      break;
+    case 'i':
+      iflag = true;
+      break;
+    case 'x':
+      fru_set_tolerant(true);
+      break;
+    case 'p':
+      pflag = true;
+      break;
+    case 'T':
+      fru_trace_enable(true);
+      atexit(tool_trace_dump);
+      break;
+    case 'f':
+      if (n_fields >= FRU_N_FIELDS) {
+        fprintf (stderr, "Too many -f options.\n");
+        return 1;
+      }
+      fvalues[n_fields++] = optarg;
+      break;
     case 'g':
       gvalue = optarg;
       break;
@@ -56,12 +147,18 @@ main (int argc, char **argv) {
     case 'd':
       dvalue = optarg;
       break;
+    case 'b':
+      bvalue = optarg;
+      break;
+    case 'R':
+      Rvalue = optarg;
+      break;
     case '?':
       if (optopt == 'g') {
         fprintf (stderr, "Option -%c requires an argument.\n", optopt);
       } else if (optopt == 's') {
         fprintf (stderr, "Option -%c requires an argument.\n", optopt);
-      } else if (optopt == 'd') {
+      } else if (optopt == 'd' || optopt == 'f' || optopt == 'b' || optopt == 'R') {
         fprintf (stderr, "Option -%c requires an argument.\n", optopt);
       } else if (isprint (optopt)) {
         fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -79,91 +176,177 @@ main (int argc, char **argv) {
     return 0;
   }
 
+  fru_set_log(tool_log);
   flog("Started\n");
   flog("mitxfru-tool %s\n", xstr(VERSION));
+  if (bvalue != NULL) {
+    if (fru_backup(bvalue) != 0) {
+      ferr("Failed to back up EEPROM\n");
+      return -11;
+    }
+    return 0;
+  }
+
+  if (Rvalue != NULL) {
+    ret = fru_restore(Rvalue, &cost, nflag);
+    if (ret != 0) {
+      ferr("Failed to restore EEPROM [%i]\n", ret);
+      return -12;
+    }
+    if (nflag) {
+      print_cost(&cost);
+    }
+    return 0;
+  }
+
+  if (pflag) {
+    ret = fru_repair(&cost, nflag);
+    if (ret != 0) {
+      ferr("Failed to repair EEPROM [%i]\n", ret);
+      return -13;
+    }
+    if (nflag) {
+      print_cost(&cost);
+    }
+    return 0;
+  }
+
   ret = fru_open_parse();
-  if (ret != 0) {
+  if (ret != 0 && !iflag) {
     ferr("Failed to load data from EEPROM\n");
     return -1;
   }
+  parsed = fru_parsed();
 
   if (rflag) {
-    printf("b_mfg_name, %s\n", fru.val_mfg_name);
-    printf("b_product_name, %s\n", fru.val_product_name);
-    printf("b_serial_number, %s\n", fru.val_serial_number);
-    printf("b_part_number, %s\n", fru.val_part_number);
-    printf("b_fru_id, %s\n", fru.val_fru_id);
-
-    printf("p_product_mfg, %s\n", fru.val_p_product_mfg);
-    printf("p_product_name, %s\n", fru.val_p_product_name);
-    printf("p_part_model_number, %s\n", fru.val_p_part_model_number);
-    printf("p_product_version, %s\n", fru.val_p_product_version);
-    printf("p_serial_number, %s\n", fru.val_p_serial_number);
-    printf("p_fru_id, %s\n", fru.val_p_fru_id);
+    printf("b_mfg_name, %s\n", parsed->val_mfg_name);
+    printf("b_product_name, %s\n", parsed->val_product_name);
+    printf("b_serial_number, %s\n", parsed->val_serial_number);
+    printf("b_part_number, %s\n", parsed->val_part_number);
+    printf("b_fru_id, %s\n", parsed->val_fru_id);
+    printf("b_mfg_date, %u\n", parsed->mfg_date[0] | (parsed->mfg_date[1]<<8) | (parsed->mfg_date[2]<<16));
+
+    printf("p_product_mfg, %s\n", parsed->val_p_product_mfg);
+    printf("p_product_name, %s\n", parsed->val_p_product_name);
+    printf("p_part_model_number, %s\n", parsed->val_p_part_model_number);
+    printf("p_product_version, %s\n", parsed->val_p_product_version);
+    printf("p_serial_number, %s\n", parsed->val_p_serial_number);
+    printf("p_fru_id, %s\n", parsed->val_p_fru_id);
     return 0;
   }
 
-  if (svalue != NULL) {
-    val = strtoul(svalue, NULL, 16);
-    if (dvalue == NULL) {
+  if (svalue != NULL || n_fields > 0) {
+    if (svalue != NULL && dvalue == NULL) {
       ferr("-d is not set, please bother yourself with reading some help\n");
       return -4;
     }
-    switch (val) {
-    case MR_MAC_REC:
-      ret = sscanf(dvalue, "%02x:%02x:%02x:%02x:%02x:%02x", (unsigned int*)&mac[0], (unsigned int*)&mac[1], (unsigned int*)&mac[2], (unsigned int*)&mac[3], (unsigned int*)&mac[4], (unsigned int*)&mac[5]);
-      if (ret<6) {
-        ferr("MAC format is not recognized; Example: 01:02:03:04:05:06\n");
-        return -5;
-      }
-      fru_mrec_update_mac(&fru, mac, 0);
-      break;
-    case MR_SATADEV_REC:
-      fru_mrec_update_bootdevice(&fru, (uint8_t*)dvalue);
-      break;
-    case MR_PASSWD_REC:
-      fru_mrec_update_passwd_line(&fru, (uint8_t*)dvalue);
-      break;
-    case MR_TESTOK_REC:
-      ret = sscanf(dvalue, "%i", (unsigned int *)&test_ok);
-      if (ret != 1) {
-        ferr("Test state format not recognized\n");
-        return -6;
-      }
-      fru_mrec_update_test_ok(&fru, test_ok);
-      break;
-    case MR_POWER_POLICY_REC:
-      ret = sscanf(dvalue, "%i", (unsigned int *)&power_policy);
-      if (ret != 1) {
-        ferr("Power policy format not recognized\n");
-        return -6;
-      }
-      fru_mrec_update_power_policy(&fru, power_policy);
-      break;
-    case MR_MAC2_REC:
-      ret = sscanf(dvalue, "%02x:%02x:%02x:%02x:%02x:%02x", (unsigned int*)&mac[0], (unsigned int*)&mac[1], (unsigned int*)&mac[2], (unsigned int*)&mac[3], (unsigned int*)&mac[4], (unsigned int*)&mac[5]);
-      if (ret<6) {
-        ferr("MAC format is not recognized; Example: 01:02:03:04:05:06\n");
-        return -5;
+    f = (iflag ? fru_edit_new() : fru_edit_begin());
+    if (f == NULL) {
+      ferr("Failed to open EEPROM for editing\n");
+      return -10;
+    }
+    for (i=0;i<n_fields;i++) {
+      eq = strchr(fvalues[i], '=');
+      if (eq == NULL) {
+        ferr("Field format is not recognized; Example: b_serial_number=0001\n");
+        return -9;
       }
-      fru_mrec_update_mac(&fru, mac, 1);
-      break;
-    case MR_MAC3_REC:
-      ret = sscanf(dvalue, "%02x:%02x:%02x:%02x:%02x:%02x", (unsigned int*)&mac[0], (unsigned int*)&mac[1], (unsigned int*)&mac[2], (unsigned int*)&mac[3], (unsigned int*)&mac[4], (unsigned int*)&mac[5]);
-      if (ret<6) {
-        ferr("MAC format is not recognized; Example: 01:02:03:04:05:06\n");
-        return -5;
+      *eq = 0;
+      if (fru_set_field(f, fvalues[i], eq+1) != 0) {
+        ferr("Cannot set field %s\n", fvalues[i]);
+        return -9;
       }
-      fru_mrec_update_mac(&fru, mac, 2);
-      break;
+    }
+    ret = 0;
+    if (svalue != NULL) {
+      val = strtoul(svalue, NULL, 16);
+      switch (val) {
+      case MR_MAC_REC:
+        ret = sscanf(dvalue, "%02x:%02x:%02x:%02x:%02x:%02x", &scan[0], &scan[1], &scan[2], &scan[3], &scan[4], &scan[5]);
+        if (ret<6) {
+          ferr("MAC format is not recognized; Example: 01:02:03:04:05:06\n");
+          return -5;
+        }
+        for (i=0;i<6;i++) {
+          mac[i] = scan[i];
+        }
+        ret = fru_mrec_update_mac(f, mac, 0);
+        break;
+      case MR_SATADEV_REC:
+        ret = fru_mrec_update_bootdevice(f, (uint8_t*)dvalue);
+        break;
+      case MR_PASSWD_REC:
+        ret = fru_mrec_update_passwd_line(f, (uint8_t*)dvalue);
+        break;
+      case MR_TESTOK_REC:
+        ret = sscanf(dvalue, "%i", (int *)&scan[0]);
+        if (ret != 1) {
+          ferr("Test state format not recognized\n");
+          return -6;
+        }
+        test_ok = scan[0];
+        ret = fru_mrec_update_test_ok(f, test_ok);
+        break;
+      case MR_POWER_POLICY_REC:
+        ret = sscanf(dvalue, "%i", (int *)&scan[0]);
+        if (ret != 1) {
+          ferr("Power policy format not recognized\n");
+          return -6;
+        }
+        power_policy = scan[0];
+        ret = fru_mrec_update_power_policy(f, power_policy);
+        break;
+      case MR_MAC2_REC:
+        ret = sscanf(dvalue, "%02x:%02x:%02x:%02x:%02x:%02x", &scan[0], &scan[1], &scan[2], &scan[3], &scan[4], &scan[5]);
+        if (ret<6) {
+          ferr("MAC format is not recognized; Example: 01:02:03:04:05:06\n");
+          return -5;
+        }
+        for (i=0;i<6;i++) {
+          mac[i] = scan[i];
+        }
+        ret = fru_mrec_update_mac(f, mac, 1);
+        break;
+      case MR_MAC3_REC:
+        ret = sscanf(dvalue, "%02x:%02x:%02x:%02x:%02x:%02x", &scan[0], &scan[1], &scan[2], &scan[3], &scan[4], &scan[5]);
+        if (ret<6) {
+          ferr("MAC format is not recognized; Example: 01:02:03:04:05:06\n");
+          return -5;
+        }
+        for (i=0;i<6;i++) {
+          mac[i] = scan[i];
+        }
+        ret = fru_mrec_update_mac(f, mac, 2);
+        break;
 
-    default:
-      ferr("Unknown multirecord id %i\n", val);
-      return -3;
-      break;
+      default:
+        ferr("Unknown multirecord id %i\n", val);
+        return -3;
+        break;
+      }
+    }
+    if (ret != 0) {
+      ferr("Failed to update multirecord %02x\n", val);
+      fru_edit_abort();
+      return -7;
     }
     flog("Updating multirecord\n");
-    fru_update_mrec_eeprom();
+    ret = fru_edit_commit(&cost, nflag);
+    if (ret != 0) {
+      ferr("Failed to write EEPROM [%i]\n", ret);
+      fru_edit_abort();
+      return -8;
+    }
+    if (nflag) {
+      print_cost(&cost);
+      fru_edit_abort();
+      return 0;
+    }
+    for (i=0;i<FRU_N_PAGES;i++) {
+      if (cost.retries[i] > 0) {
+        flog("Page %i rewritten %i times\n", i, cost.retries[i]);
+      }
+    }
     flog("Saving data to EEPROM\n");
     for (i=0;i<10;i++) {
       sleep(1);
@@ -176,25 +359,25 @@ main (int argc, char **argv) {
     val = strtoul(gvalue, NULL, 16);
     switch (val) {
     case MR_MAC_REC:
-      printf("%02x:%02x:%02x:%02x:%02x:%02x\n", fru.mac_data[0], fru.mac_data[1], fru.mac_data[2], fru.mac_data[3], fru.mac_data[4], fru.mac_data[5]);
+      printf("%02x:%02x:%02x:%02x:%02x:%02x\n", parsed->mac_data[0], parsed->mac_data[1], parsed->mac_data[2], parsed->mac_data[3], parsed->mac_data[4], parsed->mac_data[5]);
       break;
     case MR_SATADEV_REC:
-      printf("%s\n", fru.bootdevice);
+      printf("%s\n", parsed->bootdevice);
       break;
     case MR_PASSWD_REC:
-      printf("%s\n", fru.passwd_line);
+      printf("%s\n", parsed->passwd_line);
       break;
     case MR_TESTOK_REC:
-      printf("%i\n", fru.test_ok);
+      printf("%i\n", parsed->test_ok);
       break;
     case MR_POWER_POLICY_REC:
-      printf("%i\n", fru.power_policy);
+      printf("%i\n", parsed->power_policy);
       break;
     case MR_MAC2_REC:
-      printf("%02x:%02x:%02x:%02x:%02x:%02x\n", fru.mac_data[6], fru.mac_data[7], fru.mac_data[8], fru.mac_data[9], fru.mac_data[10], fru.mac_data[11]);
+      printf("%02x:%02x:%02x:%02x:%02x:%02x\n", parsed->mac_data[6], parsed->mac_data[7], parsed->mac_data[8], parsed->mac_data[9], parsed->mac_data[10], parsed->mac_data[11]);
       break;
     case MR_MAC3_REC:
-      printf("%02x:%02x:%02x:%02x:%02x:%02x\n", fru.mac_data[12], fru.mac_data[13], fru.mac_data[14], fru.mac_data[15], fru.mac_data[16], fru.mac_data[17]);
+      printf("%02x:%02x:%02x:%02x:%02x:%02x\n", parsed->mac_data[12], parsed->mac_data[13], parsed->mac_data[14], parsed->mac_data[15], parsed->mac_data[16], parsed->mac_data[17]);
       break;
     default:
       ferr("Unknown multirecord id %i\n", val);